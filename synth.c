@@ -1,23 +1,33 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <math.h>
 #include <alsa/asoundlib.h>
 #include <pthread.h>
-
-pid_t audio_pid;
-pid_t user_pid;
-pid_t midi_pid;
+#include <sched.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <fcntl.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include <sys/time.h>
 
 #define SAMPLE_RATE (44100)
 #define CYCLE_SIZE (4096)
+#define CYCLE_GUARD (1)     // spare sample so the vector kernels can read idx+1
 #define ALSA_BUFFER (1024)  // Number of samples per ALSA period
 
 #define VOICES (8)
 
-struct timeval rtns0;
-struct timeval rtns1;
 
 typedef int16_t sample_t;
 
@@ -27,25 +37,73 @@ typedef struct {
     int32_t phase_increment;
     uint32_t size;
     int32_t phase_increment_divisor;
+    uint32_t mask; // size-1 when size is a power of two, otherwise 0
 } DDS;
 
-DDS dds[VOICES];
-
 // Q17.15
 #define DDS_FRAC_BITS (15)
 #define DDS_SCALE (1 << DDS_FRAC_BITS)
 
+int32_t dds_inc(DDS *dds, double f) {
+    return (int32_t)((f * dds->size) / SAMPLE_RATE * DDS_SCALE);
+}
+
 void dds_freq(DDS *dds, double f) {
-    dds->phase_increment = (int32_t)((f * dds->size) / SAMPLE_RATE * DDS_SCALE);
+    dds->phase_increment = dds_inc(dds, f);
 }
 
 void dds_init(DDS *dds, uint32_t size, double f) {
     dds->phase_accumulator = 0;
     dds->size = size;
+    dds->mask = (size & (size - 1)) == 0 ? size - 1 : 0;
     dds->phase_increment_divisor = SAMPLE_RATE * DDS_SCALE;
     dds_freq(dds, f);
 }
 
+int32_t hz_inc(double f) {
+    return (int32_t)(f * CYCLE_SIZE / SAMPLE_RATE * DDS_SCALE);
+}
+
+double dds_hz(int32_t inc) {
+    return (double)inc * SAMPLE_RATE / ((double)CYCLE_SIZE * DDS_SCALE);
+}
+
+// pitch to phase increment
+// A pitch is in semitones above MIDI note 0, fixed point with PITCH_STEPS
+// table entries per semitone and PITCH_FRAC bits between them. The table
+// holds the increment for a CYCLE_SIZE wave at SAMPLE_RATE for every step
+// of the MIDI range, so notes, bend and glide retune with a lookup and a
+// linear interpolation, no pow() or divide on the audio thread. The table
+// is the current tuning's, equal temperament unless K loaded another.
+
+#define PITCH_STEPS (64)
+#define PITCH_FRAC (10)
+#define PITCH_ONE (PITCH_STEPS << PITCH_FRAC)  // one semitone
+#define PITCH_MAX (128 * PITCH_ONE - 1)
+
+typedef struct {
+    char name[64];
+    int32_t inc[128 * PITCH_STEPS + 1];
+} tuning_t;
+
+tuning_t tuning_12tet = { "12-TET" };
+tuning_t *tune = &tuning_12tet;  // the audio thread's, for this period
+
+void pitch_init(void) {
+    for (int i = 0; i <= 128 * PITCH_STEPS; i++) {
+        double f = 440.0 * pow(2.0, ((double)i / PITCH_STEPS - 69.0) / 12.0);
+        tuning_12tet.inc[i] = lrint(f * CYCLE_SIZE / SAMPLE_RATE * DDS_SCALE);
+    }
+}
+
+int32_t pitch_inc(int32_t p) {
+    if (p < 0) p = 0;
+    if (p > PITCH_MAX) p = PITCH_MAX;
+    int32_t a = tune->inc[p >> PITCH_FRAC];
+    int32_t b = tune->inc[(p >> PITCH_FRAC) + 1];
+    return a + (int32_t)(((int64_t)(b - a) * (p & ((1 << PITCH_FRAC) - 1))) >> PITCH_FRAC);
+}
+
 sample_t dds_step(DDS *dds, sample_t *wavetable) {
     if (dds->size == 0) return 0;
     uint32_t index = dds->phase_accumulator >> DDS_FRAC_BITS;
@@ -54,23 +112,318 @@ sample_t dds_step(DDS *dds, sample_t *wavetable) {
     return sample;
 }
 
+// Block rendering: n samples of one voice at a fixed increment.
+// On x86 an AVX2 gather or SSE2 kernel is picked at startup, everything else
+// gets the scalar loop. The vector kernels need a power-of-two size and load
+// 32 bits per lookup, which is why the tables carry CYCLE_GUARD.
+
+void dds_block_scalar(DDS *dds, const sample_t *table, float *out, int n) {
+    uint32_t acc = dds->phase_accumulator;
+    uint32_t inc = dds->phase_increment;
+    if (dds->mask) {
+        for (int i = 0; i < n; i++) {
+            out[i] = table[(acc >> DDS_FRAC_BITS) & dds->mask];
+            acc += inc;
+        }
+    } else {
+        for (int i = 0; i < n; i++) {
+            out[i] = table[(acc >> DDS_FRAC_BITS) % dds->size];
+            acc += inc;
+        }
+    }
+    dds->phase_accumulator = acc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void dds_block_sse2(DDS *dds, const sample_t *table, float *out, int n) {
+    if (dds->mask == 0) {
+        dds_block_scalar(dds, table, out, n);
+        return;
+    }
+    uint32_t acc = dds->phase_accumulator;
+    uint32_t inc = dds->phase_increment;
+    __m128i vacc = _mm_add_epi32(_mm_set1_epi32(acc),
+        _mm_setr_epi32(0, inc, 2 * inc, 3 * inc));
+    __m128i vstep = _mm_set1_epi32(4 * inc);
+    __m128i vmask = _mm_set1_epi32(dds->mask);
+    uint32_t k[4];
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i idx = _mm_and_si128(_mm_srli_epi32(vacc, DDS_FRAC_BITS), vmask);
+        _mm_storeu_si128((__m128i *)k, idx);
+        _mm_storeu_ps(&out[i], _mm_cvtepi32_ps(
+            _mm_setr_epi32(table[k[0]], table[k[1]], table[k[2]], table[k[3]])));
+        vacc = _mm_add_epi32(vacc, vstep);
+    }
+    dds->phase_accumulator = acc + (uint32_t)i * inc;
+    dds_block_scalar(dds, table, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void dds_block_avx2(DDS *dds, const sample_t *table, float *out, int n) {
+    if (dds->mask == 0) {
+        dds_block_scalar(dds, table, out, n);
+        return;
+    }
+    uint32_t acc = dds->phase_accumulator;
+    uint32_t inc = dds->phase_increment;
+    __m256i vacc = _mm256_add_epi32(_mm256_set1_epi32(acc),
+        _mm256_mullo_epi32(_mm256_set1_epi32(inc),
+            _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+    __m256i vstep = _mm256_set1_epi32(8 * inc);
+    __m256i vmask = _mm256_set1_epi32(dds->mask);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i idx = _mm256_and_si256(_mm256_srli_epi32(vacc, DDS_FRAC_BITS), vmask);
+        // gather 32 bits at table+idx, keep the low (little-endian) sample
+        __m256i v = _mm256_i32gather_epi32((const int *)table, idx, 2);
+        v = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+        _mm256_storeu_ps(&out[i], _mm256_cvtepi32_ps(v));
+        vacc = _mm256_add_epi32(vacc, vstep);
+    }
+    dds->phase_accumulator = acc + (uint32_t)i * inc;
+    dds_block_scalar(dds, table, out + i, n - i);
+}
+#endif
+
+void (*dds_kernel)(DDS *, const sample_t *, float *, int) = dds_block_scalar;
+char *dds_kernel_name = "scalar";
+
+void dds_render_init(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        dds_kernel = dds_block_avx2;
+        dds_kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        dds_kernel = dds_block_sse2;
+        dds_kernel_name = "sse2";
+    }
+#endif
+}
+
+void dds_render_block(DDS *dds, const sample_t *table, float *out, int n) {
+    if (dds->size == 0) {
+        memset(out, 0, n * sizeof(float));
+        return;
+    }
+    dds_kernel(dds, table, out, n);
+}
+
+// Frequency modulated block: the increment is base plus the modulator sample
+// scaled by k (increment per Hz, a full scale modulator swings 32768 Hz).
+// Same as dds_step() then dds_freq() per sample, the new increment takes
+// effect from the following sample.
+void dds_render_block_fm(DDS *dds, const sample_t *table, int32_t base,
+    const float *mod, float *out, int n) {
+    if (dds->size == 0) {
+        memset(out, 0, n * sizeof(float));
+        return;
+    }
+    float k = (double)dds->size * DDS_SCALE * 32768.0 / SAMPLE_RATE;
+    uint32_t acc = dds->phase_accumulator;
+    int32_t inc = dds->phase_increment;
+    for (int i = 0; i < n; i++) {
+        uint32_t index = acc >> DDS_FRAC_BITS;
+        out[i] = table[dds->mask ? index & dds->mask : index % dds->size];
+        acc += inc;
+        inc = base + (int32_t)(mod[i] * k);
+    }
+    dds->phase_accumulator = acc;
+    dds->phase_increment = inc;
+}
+
+// output formats: the engine renders float with 1 as full scale and the
+// last step converts to whatever the device took, saturating, so loud
+// chords clip instead of wrapping.
+
+enum { FMT_S16, FMT_S32, FMT_FLOAT, FMT_COUNT };
+char *format_names[] = { "s16", "s32", "float" };
+int want_format = -1;  // -F, otherwise the device's pick of float, s32, s16
+int out_format = FMT_S16;
+int out_bytes = 2;
+
+#define S32_TOP (2147483520.0f)  // largest float under 2^31
+
+void to_s16_scalar(const float *in, void *out, int n) {
+    int16_t *o = out;
+    for (int i = 0; i < n; i++) {
+        float x = in[i] * 32768.0f;
+        o[i] = x >= 32767.0f ? 32767 : x <= -32768.0f ? -32768 : lrintf(x);
+    }
+}
+
+void to_s32_scalar(const float *in, void *out, int n) {
+    int32_t *o = out;
+    for (int i = 0; i < n; i++) {
+        float x = in[i] * 2147483648.0f;
+        o[i] = x >= S32_TOP ? (int32_t)S32_TOP : x <= -2147483648.0f ? INT32_MIN : lrintf(x);
+    }
+}
+
+void to_float_scalar(const float *in, void *out, int n) {
+    float *o = out;
+    for (int i = 0; i < n; i++) o[i] = in[i] > 1.0f ? 1.0f : in[i] < -1.0f ? -1.0f : in[i];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void to_s16_sse2(const float *in, void *out, int n) {
+    int16_t *o = out;
+    __m128 scale = _mm_set1_ps(32768.0f);
+    __m128 hi = _mm_set1_ps(32767.0f);
+    __m128 lo = _mm_set1_ps(-32768.0f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(&in[i]), scale);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(&in[i + 4]), scale);
+        a = _mm_max_ps(_mm_min_ps(a, hi), lo);
+        b = _mm_max_ps(_mm_min_ps(b, hi), lo);
+        _mm_storeu_si128((__m128i *)&o[i],
+            _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+    }
+    to_s16_scalar(in + i, o + i, n - i);
+}
+
+__attribute__((target("sse2")))
+void to_s32_sse2(const float *in, void *out, int n) {
+    int32_t *o = out;
+    __m128 scale = _mm_set1_ps(2147483648.0f);
+    __m128 hi = _mm_set1_ps(S32_TOP);
+    __m128 lo = _mm_set1_ps(-2147483648.0f);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(&in[i]), scale);
+        a = _mm_max_ps(_mm_min_ps(a, hi), lo);
+        _mm_storeu_si128((__m128i *)&o[i], _mm_cvtps_epi32(a));
+    }
+    to_s32_scalar(in + i, o + i, n - i);
+}
+
+__attribute__((target("sse2")))
+void to_float_sse2(const float *in, void *out, int n) {
+    float *o = out;
+    __m128 hi = _mm_set1_ps(1.0f);
+    __m128 lo = _mm_set1_ps(-1.0f);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(&o[i], _mm_max_ps(_mm_min_ps(_mm_loadu_ps(&in[i]), hi), lo));
+    }
+    to_float_scalar(in + i, o + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void to_s16_avx2(const float *in, void *out, int n) {
+    int16_t *o = out;
+    __m256 scale = _mm256_set1_ps(32768.0f);
+    __m256 hi = _mm256_set1_ps(32767.0f);
+    __m256 lo = _mm256_set1_ps(-32768.0f);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 a = _mm256_mul_ps(_mm256_loadu_ps(&in[i]), scale);
+        __m256 b = _mm256_mul_ps(_mm256_loadu_ps(&in[i + 8]), scale);
+        a = _mm256_max_ps(_mm256_min_ps(a, hi), lo);
+        b = _mm256_max_ps(_mm256_min_ps(b, hi), lo);
+        // packs works per 128-bit lane, put the quadwords back in order
+        __m256i p = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+        _mm256_storeu_si256((__m256i *)&o[i], _mm256_permute4x64_epi64(p, 0xd8));
+    }
+    to_s16_sse2(in + i, o + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void to_s32_avx2(const float *in, void *out, int n) {
+    int32_t *o = out;
+    __m256 scale = _mm256_set1_ps(2147483648.0f);
+    __m256 hi = _mm256_set1_ps(S32_TOP);
+    __m256 lo = _mm256_set1_ps(-2147483648.0f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 a = _mm256_mul_ps(_mm256_loadu_ps(&in[i]), scale);
+        a = _mm256_max_ps(_mm256_min_ps(a, hi), lo);
+        _mm256_storeu_si256((__m256i *)&o[i], _mm256_cvtps_epi32(a));
+    }
+    to_s32_sse2(in + i, o + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void to_float_avx2(const float *in, void *out, int n) {
+    float *o = out;
+    __m256 hi = _mm256_set1_ps(1.0f);
+    __m256 lo = _mm256_set1_ps(-1.0f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(&o[i], _mm256_max_ps(_mm256_min_ps(_mm256_loadu_ps(&in[i]), hi), lo));
+    }
+    to_float_sse2(in + i, o + i, n - i);
+}
+#endif
+
+void (*converters[FMT_COUNT][3])(const float *, void *, int) = {
+#if defined(__x86_64__) || defined(__i386__)
+    { to_s16_scalar, to_s16_sse2, to_s16_avx2 },
+    { to_s32_scalar, to_s32_sse2, to_s32_avx2 },
+    { to_float_scalar, to_float_sse2, to_float_avx2 },
+#else
+    { to_s16_scalar, to_s16_scalar, to_s16_scalar },
+    { to_s32_scalar, to_s32_scalar, to_s32_scalar },
+    { to_float_scalar, to_float_scalar, to_float_scalar },
+#endif
+};
+char *converter_names[] = { "scalar", "sse2", "avx2" };
+
+void (*convert)(const float *, void *, int) = to_s16_scalar;
+char *convert_name = "scalar";
+
+void format_set(int f) {
+    int level = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) level = 2;
+    else if (__builtin_cpu_supports("sse2")) level = 1;
+#endif
+    out_format = f;
+    out_bytes = f == FMT_S16 ? 2 : 4;
+    convert = converters[f][level];
+    convert_name = converter_names[level];
+}
+
+int format_parse(char *name) {
+    for (int f = 0; f < FMT_COUNT; f++) {
+        if (strcasecmp(name, format_names[f]) == 0) return f;
+    }
+    return -1;
+}
+
+#define PERIODS (4)  // periods in the ALSA ring
+#define LATENCY (2)  // periods kept queued
+
 // ALSA variables
 snd_pcm_t *pcm_handle;
 snd_pcm_hw_params_t *hw_params;
-
-sample_t sine[CYCLE_SIZE];
-sample_t cosine[CYCLE_SIZE];
-sample_t sqr[CYCLE_SIZE];
-sample_t tri[CYCLE_SIZE];
-sample_t sawup[CYCLE_SIZE];
-sample_t sawdown[CYCLE_SIZE];
-sample_t noise[CYCLE_SIZE];
-sample_t none[CYCLE_SIZE];
-sample_t usr0[CYCLE_SIZE];
-sample_t usr1[CYCLE_SIZE];
-sample_t usr2[CYCLE_SIZE];
-sample_t usr3[CYCLE_SIZE];
-sample_t usr4[CYCLE_SIZE];
+snd_pcm_sw_params_t *sw_params;
+int pcm_mmap;  // rendering straight into the mmap ring
+int pcm_periods = PERIODS;
+snd_pcm_uframes_t pcm_buffer;
+snd_pcm_sframes_t pcm_room;   // avail needed before the next period goes in
+snd_pcm_sframes_t pcm_delay;  // frames queued after the last write
+int pcm_latency;              // periods the sw params are set for
+int latency = LATENCY;        // periods wanted, L
+
+sample_t sine[CYCLE_SIZE + CYCLE_GUARD];
+sample_t cosine[CYCLE_SIZE + CYCLE_GUARD];
+sample_t sqr[CYCLE_SIZE + CYCLE_GUARD];
+sample_t tri[CYCLE_SIZE + CYCLE_GUARD];
+sample_t sawup[CYCLE_SIZE + CYCLE_GUARD];
+sample_t sawdown[CYCLE_SIZE + CYCLE_GUARD];
+sample_t noise[CYCLE_SIZE + CYCLE_GUARD];
+sample_t none[CYCLE_SIZE + CYCLE_GUARD];
+sample_t usr0[CYCLE_SIZE + CYCLE_GUARD];
+sample_t usr1[CYCLE_SIZE + CYCLE_GUARD];
+sample_t usr2[CYCLE_SIZE + CYCLE_GUARD];
+sample_t usr3[CYCLE_SIZE + CYCLE_GUARD];
+sample_t usr4[CYCLE_SIZE + CYCLE_GUARD];
 
 #define MAX_VALUE 32767
 #define MIN_VALUE -32767
@@ -143,11 +496,29 @@ void make_none(sample_t *table, int size) {
 
 
 // ALSA error handler
-void check_alsa_error(int err, const char *msg) {
+int check_alsa_error(int err, const char *msg) {
     if (err < 0) {
         fprintf(stderr, "%s: %s\n", msg, snd_strerror(err));
-        exit(EXIT_FAILURE);
     }
+    return err;
+}
+
+// keep at most n periods queued: wake up when a period fits under that,
+// start playing once it is reached
+int alsa_latency(int n) {
+    int err;
+    if (n < 1) n = 1;
+    if (n > pcm_periods) n = pcm_periods;
+    snd_pcm_sw_params_current(pcm_handle, sw_params);
+    pcm_room = pcm_buffer - (n - 1) * ALSA_BUFFER;
+    snd_pcm_sw_params_set_avail_min(pcm_handle, sw_params, pcm_room);
+    snd_pcm_sw_params_set_start_threshold(pcm_handle, sw_params, n * ALSA_BUFFER);
+    if ((err = snd_pcm_sw_params(pcm_handle, sw_params)) < 0) {
+        return check_alsa_error(err, "Cannot set software parameters");
+    }
+    pcm_latency = n;
+    latency = n;
+    return 0;
 }
 
 // ALSA setup
@@ -157,6 +528,7 @@ int setup_alsa(char *device) {
     // Open ALSA device for playback
     if ((err = snd_pcm_open(&pcm_handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
         check_alsa_error(err, "Cannot open PCM device");
+        pcm_handle = NULL;
         return -1;
     }
 
@@ -164,22 +536,64 @@ int setup_alsa(char *device) {
     snd_pcm_hw_params_malloc(&hw_params);
     snd_pcm_hw_params_any(pcm_handle, hw_params);
 
-    // Set hardware parameters
-    snd_pcm_hw_params_set_access(pcm_handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
-    snd_pcm_hw_params_set_format(pcm_handle, hw_params, SND_PCM_FORMAT_S16_LE);
+    // Set hardware parameters, mmap when the device can do it
+    pcm_mmap = snd_pcm_hw_params_set_access(pcm_handle, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0;
+    if (!pcm_mmap) {
+        snd_pcm_hw_params_set_access(pcm_handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    }
+    // the format asked for with -F, otherwise the best the device takes
+    snd_pcm_format_t alsa_formats[] = { SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_FLOAT_LE };
+    int prefer[] = { FMT_FLOAT, FMT_S32, FMT_S16 };
+    int format = -1;
+    for (int k = 0; k < FMT_COUNT && format < 0; k++) {
+        int f = want_format >= 0 ? want_format : prefer[k];
+        if (snd_pcm_hw_params_test_format(pcm_handle, hw_params, alsa_formats[f]) == 0 &&
+            snd_pcm_hw_params_set_format(pcm_handle, hw_params, alsa_formats[f]) == 0) format = f;
+        if (want_format >= 0) break;
+    }
+    if (format < 0) {
+        fprintf(stderr, "PCM device takes none of %s\n",
+            want_format >= 0 ? format_names[want_format] : "float, s32, s16");
+        snd_pcm_hw_params_free(hw_params);
+        snd_pcm_close(pcm_handle);
+        pcm_handle = NULL;
+        return -1;
+    }
+    format_set(format);
     snd_pcm_hw_params_set_channels(pcm_handle, hw_params, 1);  // Mono output
     snd_pcm_hw_params_set_rate(pcm_handle, hw_params, SAMPLE_RATE, 0);
     snd_pcm_hw_params_set_period_size(pcm_handle, hw_params, ALSA_BUFFER, 0);
+    unsigned int periods = pcm_periods;
+    snd_pcm_hw_params_set_periods_near(pcm_handle, hw_params, &periods, NULL);
 
     // Apply hardware parameters
     if ((err = snd_pcm_hw_params(pcm_handle, hw_params)) < 0) {
         check_alsa_error(err, "Cannot set hardware parameters");
+        snd_pcm_hw_params_free(hw_params);
+        snd_pcm_close(pcm_handle);
+        pcm_handle = NULL;
         return -1;
     }
 
+    snd_pcm_hw_params_get_buffer_size(hw_params, &pcm_buffer);
+    pcm_periods = pcm_buffer / ALSA_BUFFER;
+
     // Free hardware parameters structure
     snd_pcm_hw_params_free(hw_params);
 
+    if (pcm_periods < 1) {
+        fprintf(stderr, "PCM buffer of %lu frames is smaller than a period\n", pcm_buffer);
+        snd_pcm_close(pcm_handle);
+        pcm_handle = NULL;
+        return -1;
+    }
+    snd_pcm_sw_params_malloc(&sw_params);
+    if ((err = alsa_latency(latency)) < 0) {
+        snd_pcm_close(pcm_handle);
+        pcm_handle = NULL;
+        return -1;
+    }
+
     // Prepare PCM for playback
     snd_pcm_prepare(pcm_handle);
     return 0;
@@ -220,134 +634,182 @@ int running = 1;
 
 #define WAVE_MAX (12)
 
-double of[VOICES];
-double oft[VOICES];
-int ofg[VOICES];
-double ofgd[VOICES];
-double on[VOICES];
-double oa[VOICES];
-int oe[VOICES];
-int ow[VOICES];
-
-// LFO-ey stuff
-// TODO
-int ismod[VOICES];
-int cachemod[VOICES];
-int ofm[VOICES]; // choose which oscillator is a frequency modulator
-int oam[VOICES]; // choose which oscillator is a amplitude modulator
-int opm[VOICES]; // choose which oscillator is a panning modulator
-
-// amplitude ratio... this influences the oa
-int top[VOICES];
-int bot[VOICES];
-
-#include "linenoise.h"
+// tracing: begin/end spans and instants go into a ring per thread, T1
+// starts it, T0 stops it, T writes what the rings hold as Chrome trace
+// JSON (Perfetto opens it). A full ring overwrites its oldest events.
 
-unsigned long long sent = 0;
+#define TRACE_RING (16384)
+#define TRACE_THREADS (72)
 
-int agcd(int a, int b) {
-    while (b != 0) {
-        int temp = a % b;
-        a = b;
-        b = temp;
-    }
-    return a;
-}
+typedef struct {
+    const char *name;
+    long ts;      // CLOCK_MONOTONIC ns
+    int32_t arg;
+    char ph;      // 'B', 'E' or 'i'
+} trace_ev_t;
 
-void calc_ratio(int index) {
-    int precision = 10000;
-    int ip = oa[index] * precision;
-    int gcd = agcd(abs(ip), precision);
-    top[index] = ip / gcd;
-    bot[index] = precision / gcd;
+typedef struct {
+    char name[16];
+    pid_t tid;
+    atomic_uint head;
+    _Atomic(trace_ev_t *) ev; // set last by the owner, the dump skips it till then
+} trace_ring_t;
+
+atomic_int trace_on;
+trace_ring_t trace_rings[TRACE_THREADS];
+atomic_int trace_nthreads;
+_Thread_local trace_ring_t *trace_self;
+
+// called by each thread on itself
+void trace_thread(char *name) {
+    int k = atomic_fetch_add(&trace_nthreads, 1);
+    if (k >= TRACE_THREADS) return;
+    trace_ring_t *r = &trace_rings[k];
+    trace_ev_t *ev = calloc(TRACE_RING, sizeof(trace_ev_t));
+    if (ev == NULL) return;
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->tid = syscall(SYS_gettid);
+    atomic_store_explicit(&r->ev, ev, memory_order_release);
+    trace_self = r;
 }
 
-long mytol(char *str, int *valid, int *next) {
-    long val;
-    char *endptr;
-    val = strtol(str, &endptr, 10);
-    if (endptr == str) {
-        if (valid) *valid = 0;
-        if (next) *next = 0;
-        return 0;
-    }
-    if (valid) *valid = 1;
-    if (next) *next = endptr - str + 1;
-    return val;
+void trace(const char *name, char ph, int32_t arg) {
+    trace_ring_t *r = trace_self;
+    if (r == NULL || !atomic_load_explicit(&trace_on, memory_order_relaxed)) return;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    trace_ev_t *e = &atomic_load_explicit(&r->ev, memory_order_relaxed)[h % TRACE_RING];
+    e->name = name;
+    e->ts = ts.tv_sec * 1000000000L + ts.tv_nsec;
+    e->arg = arg;
+    e->ph = ph;
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
 }
 
-double mytod(char *str, int *valid, int *next) {
-    double val;
-    char *endptr;
-    val = strtod(str, &endptr);
-    if (endptr == str) {
-        if (valid) *valid = 0;
-        if (next) *next = 0;
-        return 0;
+void trace_dump(void) {
+    char template[] = "traceXXXXXX.json";
+    int fd = mkstemps(template, 5);
+    if (fd < 0) {
+        puts("FAIL");
+        perror("mkstemps");
+        return;
     }
-    if (valid) *valid = 1;
-    if (next) *next = endptr - str + 1;
-    return val;
-}
-
-char *mytok(char *str, char tok, int *next) {
-    int n = 0;
-    while (1) {
-        if (str[n] == tok) {
-            str[n] = '\0';
-            if (next) *next = n+1;
-            return str;
+    int was = atomic_exchange(&trace_on, 0);
+    FILE *f = fdopen(fd, "w");
+    int pid = getpid();
+    int threads = atomic_load(&trace_nthreads);
+    if (threads > TRACE_THREADS) threads = TRACE_THREADS;
+    char *sep = "";
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (int k = 0; k < threads; k++) {
+        trace_ring_t *r = &trace_rings[k];
+        trace_ev_t *ev = atomic_load_explicit(&r->ev, memory_order_acquire);
+        if (ev == NULL) continue;
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+            "\"args\":{\"name\":\"%s\"}}", sep, pid, r->tid, r->name);
+        sep = ",\n";
+        unsigned h = atomic_load_explicit(&r->head, memory_order_acquire);
+        for (unsigned i = h > TRACE_RING ? h - TRACE_RING : 0; i < h; i++) {
+            trace_ev_t *e = &ev[i % TRACE_RING];
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+                e->name, e->ph, e->ts / 1000.0, pid, r->tid);
+            if (e->ph == 'i') fprintf(f, ",\"s\":\"t\",\"args\":{\"v\":%d}", e->arg);
+            fputc('}', f);
         }
     }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    atomic_store(&trace_on, was);
+    printf("created %s\n", template);
 }
 
-long int rtms = 0;
-long int btms = 0;
-long int diff = 0;
+// logging from the audio path: LOG() drops a binary record into the
+// calling thread's ring and never waits, a full ring counts a drop. The
+// user thread formats whatever is there after each line. V<n> sets the
+// verbosity, building with -DNOLOG removes the calls altogether.
 
-#define LATENCY_HACK_MS (100)
+#define LOG_RING (4096)
+#define LOG_THREADS (72)
 
-int latency_hack_ms = LATENCY_HACK_MS;
-char *device = "default";
-int voice = 0;
+enum { LOG_OFF, LOG_INFO, LOG_DEBUG };
 
-void *midi(void *arg) {
-    midi_pid = getpid();
-    while (running) {
-        sleep(5);
-    }
-}
+typedef struct {
+    const char *fmt;   // a literal, formatted by the reader
+    int32_t arg[3];
+} log_rec_t;
 
-// inspired by AMY :)
-#define SINE 0
-#define SQR  1
-#define SAWD 2
-#define SAWU 3
-#define TRI  4
-#define NOIZ 5
-#define USR0 6
-#define USR1 7
-#define USR2 8
-#define USR3 9
-#define USR4 10
-#define NONE 11
+typedef struct {
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_ulong dropped;    // only the owner counts, it only goes up
+    unsigned long reported;  // the drainer's
+    _Atomic(log_rec_t *) rec; // set once by the owner, the drainer skips it till then
+} log_ring_t;
+
+atomic_int log_level = LOG_INFO;
+log_ring_t log_rings[LOG_THREADS];
+atomic_int log_nthreads;
+_Thread_local log_ring_t *log_self;
+
+// called by each thread on itself
+void log_thread(void) {
+    int k = atomic_fetch_add(&log_nthreads, 1);
+    if (k >= LOG_THREADS) return;
+    log_ring_t *r = &log_rings[k];
+    log_rec_t *rec = calloc(LOG_RING, sizeof(log_rec_t));
+    if (rec == NULL) return;
+    atomic_store_explicit(&r->rec, rec, memory_order_release);
+    log_self = r;
+}
 
-void dump(sample_t *wave) {
-    int c = 0;
-    char template[] = "waveXXXXXX";
-    int fd = mkstemp(template);
-    if (fd < 0) {
-        puts("FAIL");
-        perror("mkstemp");
+void log_put(const char *fmt, int32_t a, int32_t b, int32_t c) {
+    log_ring_t *r = log_self;
+    if (r == NULL) return;
+    unsigned h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (h - atomic_load_explicit(&r->tail, memory_order_acquire) >= LOG_RING) {
+        unsigned long d = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+        atomic_store_explicit(&r->dropped, d + 1, memory_order_relaxed);
         return;
     }
-    printf("created %s\n", template);
-    char buf[80];
-    for (int i=0; i<CYCLE_SIZE; i++) {
-        sprintf(buf, "%d\n", wave[i]);
-        write(fd, buf, strlen(buf));
+    log_rec_t *l = &atomic_load_explicit(&r->rec, memory_order_relaxed)[h % LOG_RING];
+    l->fmt = fmt;
+    l->arg[0] = a;
+    l->arg[1] = b;
+    l->arg[2] = c;
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+#ifdef NOLOG
+#define LOG(level, fmt, a, b, c) ((void)0)
+#else
+#define LOG(level, fmt, a, b, c) do { \
+    if ((level) <= atomic_load_explicit(&log_level, memory_order_relaxed)) \
+        log_put(fmt, a, b, c); \
+} while (0)
+#endif
+
+void log_drain(void) {
+    int threads = atomic_load(&log_nthreads);
+    if (threads > LOG_THREADS) threads = LOG_THREADS;
+    for (int k = 0; k < threads; k++) {
+        log_ring_t *r = &log_rings[k];
+        log_rec_t *rec = atomic_load_explicit(&r->rec, memory_order_acquire);
+        if (rec == NULL) continue;
+        unsigned h = atomic_load_explicit(&r->head, memory_order_acquire);
+        unsigned t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        for (; t != h; t++) {
+            log_rec_t *l = &rec[t % LOG_RING];
+            printf(l->fmt, l->arg[0], l->arg[1], l->arg[2]);
+            putchar('\n');
+            atomic_store_explicit(&r->tail, t + 1, memory_order_release);
+        }
+        unsigned long d = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+        if (d != r->reported) {
+            printf("(%lu log records dropped)\n", d - r->reported);
+            r->reported = d;
+        }
     }
-    close(fd);
 }
 
 // simple ADSR
@@ -359,7 +821,6 @@ void dump(sample_t *wave) {
 // Q17.15
 #define ENV_FRAC_BITS 14
 #define ENV_SCALE (1 << ENV_FRAC_BITS)
-#define ENV_MAX INT32_MAX
 
 enum {
     ENV_IDLE,
@@ -438,9 +899,13 @@ void env_off(env_t* env) {
     env->stage = ENV_RELEASE;
 }
 
-sample_t env_next(env_t* env) {
+char *env_trace[] = { "env idle", "env attack", "env decay", "env sustain", "env release" };
+
+// the envelope gain for the next sample, 0 to 1 at ENV_SCALE
+float env_next(env_t* env) {
     if (env->last_stage != env->stage) {
-        printf("ENV %d -> %d (%d)\n", env->last_stage, env->stage, env->current_level);
+        trace(env_trace[env->stage], 'i', env->current_level);
+        LOG(LOG_INFO, "ENV %d -> %d (%d)", env->last_stage, env->stage, env->current_level);
         env->last_stage = env->stage;
     }
     switch (env->stage) {
@@ -474,162 +939,2091 @@ sample_t env_next(env_t* env) {
             }
             break;
     }
-    // Convert to 16-bit signed integer range
     if (env->current_level != env->last_level) {
-        printf("%d\n", env->current_level);
+        LOG(LOG_DEBUG, "%d", env->current_level, 0, 0);
         env->last_level = env->current_level;
     }
-    return ((env->current_level * ENV_MAX) >> ENV_FRAC_BITS);
+    return env->current_level * (1.0f / ENV_SCALE);
 }
 
-env_t env[VOICES];
+// voice pool, sized at startup with -v and allocated once
 
-long long int total_cpu_usage(void) {
-    long long int t;
-    FILE *f = fopen("/proc/stat", "rt");
-    if (f) {
-        char buf[1024];
-        char *line = fgets(buf, sizeof(buf), f);
-        if (line) {
-            long long int user;
-            long long int nice;
-            long long int system;
-            long long int idle;
-            int n = sscanf(line, "%*s %llu %llu %llu %llu", &user, &nice, &system, &idle);
-            // printf("n:%d %llu %llu %llu %llu\n", n, user, nice, system, idle);
-            t = user + nice + system + idle;
-        }
-        fclose(f);
-        return t;
+typedef struct {
+    int32_t oi;  // base phase increment, the carrier's with FM
+    int32_t op;  // pitch, -1 when f set a frequency
+    int32_t opt; // glide target
+    int64_t opd; // glide step per frame << 16
+    int32_t opr; // glide position below op, << 16
+    int ofg;     // glide time, ms
+    double on;
+    double oa;
+    int oe;
+    int ow;
+
+    // LFO-ey stuff
+    // TODO
+    int ismod;
+    int ofm; // choose which oscillator is a frequency modulator
+    int oam; // choose which oscillator is a amplitude modulator
+    int opm; // choose which oscillator is a panning modulator
+
+    // amplitude ratio... this influences the oa
+    int top;
+    int bot;
+
+    DDS dds;
+    env_t env;
+
+    int live;
+    float *buf; // one period of scratch, modulators keep theirs for the carriers
+    int len;    // frames buf holds
+
+    // scheduling: dependency level this period and render cost estimate (ns)
+    int lvl;
+    int need;
+    int share;
+    uint32_t cost;
+
+    // allocator bookkeeping, note is -1 unless N put it there
+    int note;
+    int gate;
+    unsigned long long age;
+} voice_t;
+
+#define VOICES_MAX (1024)
+
+voice_t *pool;
+size_t pool_bytes;
+int voices = VOICES;
+int voice = 0; // selected voice
+
+// real-time mode, -R priority [-C cpu], see rt_setup()
+int rt_prio = 0;
+int rt_cpu = -1;
+
+// render workers and their deadline bookkeeping, see synth()
+int workers = 0;
+long sched_ns;
+long sched_max_ns;
+unsigned long sched_late;
+int sched_levels;
+
+// render-ahead pipeline, -d depth: a render thread keeps up to depth
+// periods ready while the audio thread feeds the backend, see pipe_render()
+#define PIPE_MAX (16)
+int pipe_depth = 0;
+char *pipe_buf;
+atomic_uint pipe_head;  // periods rendered
+atomic_uint pipe_tail;  // periods handed to the backend
+atomic_uint pipe_done;
+unsigned pipe_low = PIPE_MAX;  // fewest periods ready when one was taken
+unsigned long pipe_dry;        // times the backend found none ready
+pthread_t pipe_thread;
+
+// look-ahead limiter on the mix bus, -l ms, see limit()
+int limit_la = 0;        // frames of look-ahead, 0 is off
+float limit_low = 1.0f;  // lowest gain since the last ??
+
+int voice_pool_init(int n) {
+    size_t head = (n * sizeof(voice_t) + 63) & ~(size_t)63;
+    pool_bytes = head + (size_t)n * ALSA_BUFFER * sizeof(float);
+    char *mem = aligned_alloc(64, pool_bytes);
+    if (mem == NULL) return -1;
+    memset(mem, 0, pool_bytes);
+    pool = (voice_t *)mem;
+    for (int i=0; i<n; i++) {
+        pool[i].buf = (float *)(mem + head) + (size_t)i * ALSA_BUFFER;
+        pool[i].note = -1;
     }
-    return t;
+    voices = n;
+    return 0;
 }
 
-long int pid_times(pid_t pid) {
-    char file[1024];
-    sprintf(file, "/proc/%d/stat", (int)pid);
-    long long int t;
-    FILE *f = fopen(file, "rt");
-    if (f) {
-        char buf[1024];
-        char *line = fgets(buf, sizeof(buf), f);
-        if (line) {
-            long int usertime;
-            long int systemtime;
-            int n = sscanf(line,
-                "%*s %*s %*s %*s" //pid,command,state,ppid
-                "%*s %*s %*s %*s %*s %*s %*s %*s %*s"
-                "%lu %lu" //usertime,systemtime
-                "%*s %*s %*s %*s %*s %*s %*s"
-                "%*s", //virtual memory size in bytes
-                
-                &usertime, &systemtime);
-            // printf("n:%d %lu %lu\n", n, usertime, systemtime);
-            t = usertime + systemtime;
-        }
-        fclose(f);
-        return t;
+#include "linenoise.h"
+
+unsigned long long sent = 0;
+
+int agcd(int a, int b) {
+    while (b != 0) {
+        int temp = a % b;
+        a = b;
+        b = temp;
     }
-    return t;
+    return a;
 }
 
-void show_voice(char flag, int i) {
-    printf("%c v%d w%d f%.4f e%d a%.4f",
-        flag, i, ow[i], of[i], oe[i], oa[i]);
-    // printf(" t%d b%d", top[i], bot[i]);
-    if (ismod[i]) printf(" M%d", ismod[i]);
-    if (ofm[i] >= 0) printf(" F%d", ofm[i]);
-    if (oe[i]) printf(" B%d,%d,%d,%d,%d",
-        env[i].attack_ms,
-        env[i].decay_ms,
-        env[i].release_ms,
-        env[i].attack_level,
-        env[i].sustain_level);
-    if (ofg[i]) printf(" G%d (%f/%f)", ofg[i], ofgd[i], oft[i]);
-    puts("");
+void calc_ratio(int index) {
+    int precision = 10000;
+    int ip = pool[index].oa * precision;
+    int gcd = agcd(abs(ip), precision);
+    pool[index].top = ip / gcd;
+    pool[index].bot = precision / gcd;
 }
 
-void cpu_usage(char *name, pid_t pid) {
-    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
-    // printf("ncpu=%d\n", ncpu);
-    long long t1 = total_cpu_usage();
-    // printf("t1 = %llu\n", t1);
-    long p1 = pid_times(pid);
-    // printf("p1=%ld\n", p1);
-    sleep(1);
-    long long t2 = total_cpu_usage();
-    // printf("t2 = %llu\n", t2);
-    long p2 = pid_times(pid);
-    // printf("p2=%ld\n", p2);
-    double usage = (ncpu * (p2-p1)) * 100 / (double)(t2-t1);
-    printf("%s cpu-usage=%g\n", name, usage);
+// voice allocator for N: a free voice if there is one, otherwise steal
+// one of the allocated voices by policy. New notes take their patch from
+// the voice that was selected when the note was sent.
+
+#define STEAL_OLDEST 0
+#define STEAL_QUIETEST 1
+#define STEAL_SAMENOTE 2
+
+char *steal_names[] = { "oldest", "quietest", "same-note" };
+int steal = STEAL_OLDEST;
+unsigned long long note_clock = 0;
+int32_t bend = 0; // pitch, from MIDI pitch bend, moves the N notes only
+
+void voice_tune(voice_t *v) {
+    v->oi = pitch_inc(v->op + (v->note >= 0 ? bend : 0));
+    v->dds.phase_increment = v->oi;
 }
 
-int wire(char *line) {
-    int p = 0;
-    int valid;
-    while (line[p] != '\0') {
-        valid = 1;
-        char c = line[p++];
-        int next;
-        if (c == ' ' || c == '\t' || c == '\r' || c == ';') continue;
-        if (c == '#') break;
-        if (c == ':') {
-            char peek = line[p];
-            if (peek == 'c') {
-                p++;
-                printf("%c[2J%c[H\n", 27, 27);
-            } else if (peek == 'q') {
-                p++;
-                puts("");
-                running = 0;
-                return -1;
-            }
-        } else if (c == '~') {
-            // sleep n ms
-            int ms = mytol(&line[p], &valid, &next);
-            if (!valid) break; else p += next-1;
-            usleep(ms * 1000);
-        } else if (c == '?') {
-            char peek = line[p];
-            if (peek == '?') {
+// retune v to pitch p, gliding from where it is when it has a glide time
+void voice_pitch(voice_t *v, int32_t p) {
+    v->opt = p;
+    if (v->ofg > 0 && v->op >= 0 && v->op != p) {
+        v->opd = ((int64_t)(p - v->op) << 16) / ((int64_t)v->ofg * SAMPLE_RATE / 1000);
+        if (v->opd == 0) v->opd = p > v->op ? 1 : -1;
+        v->opr = 0;
+        return;
+    }
+    v->op = p;
+    voice_tune(v);
+}
+
+// move a gliding voice on by n frames, keeping what doesn't make a whole
+// pitch step for the next span
+void voice_glide(voice_t *v, int n) {
+    int64_t d = v->opd * n + v->opr;
+    int64_t p = v->op + (d >> 16);
+    v->opr = d & 0xffff;
+    if (v->opd >= 0 ? p >= v->opt : p <= v->opt) p = v->opt;
+    v->op = p;
+    voice_tune(v);
+}
+
+// tunings, K file.scl [file.kbm]
+// A Scala scale and keyboard mapping compile into a whole pitch table on
+// the user thread. Each key sits one table semitone above the last
+// whatever its interval, so bend and glide move in keys. The new table is
+// swapped in and synth() picks it up at the top of a period. It publishes
+// the one it holds in tuning_held, rechecking so a table swapped out in
+// between is never used, and a retired table is freed once it isn't held.
+
+#define SCL_MAX (1024)
+#define TUNING_RETIRED (8)
+
+typedef struct {
+    int size;    // 0 maps every key to the next degree
+    int first;
+    int last;
+    int middle;  // key for degree 0
+    int ref;     // key tuned to freq
+    double freq;
+    int octave;  // degree the mapping repeats at
+    int map[128];  // degree per key, -1 unmapped
+} kbm_t;
+
+_Atomic(tuning_t *) tuning = &tuning_12tet;
+_Atomic(tuning_t *) tuning_held = &tuning_12tet;
+tuning_t *tuning_retired[TUNING_RETIRED];
+
+// next line that isn't a comment, NULL at the end
+char *scl_line(char *line, int size, FILE *f) {
+    while (fgets(line, size, f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '!') return line;
+    }
+    return NULL;
+}
+
+// read the description and the cents of degrees 1..n, the last of them
+// the period, and return n
+int scl_load(char *path, char *desc, int size, double *cents) {
+    char line[256];
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    int n = -1;
+    if (scl_line(line, sizeof(line), f)) {
+        snprintf(desc, size, "%s", line + strspn(line, " \t"));
+        if (scl_line(line, sizeof(line), f)) n = atoi(line);
+    }
+    if (n < 1 || n > SCL_MAX) {
+        fprintf(stderr, "%s: no scale\n", path);
+        fclose(f);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (scl_line(line, sizeof(line), f) == NULL) {
+            fprintf(stderr, "%s: %d of %d degrees\n", path, i, n);
+            fclose(f);
+            return -1;
+        }
+        char *s = line + strspn(line, " \t");
+        if (memchr(s, '.', strcspn(s, " \t"))) {
+            cents[i] = strtod(s, NULL);
+        } else {
+            char *end;
+            double num = strtol(s, &end, 10);
+            double den = *end == '/' ? strtol(end + 1, NULL, 10) : 1;
+            if (num <= 0 || den <= 0) {
+                fprintf(stderr, "%s: bad ratio %s\n", path, s);
+                fclose(f);
+                return -1;
+            }
+            cents[i] = 1200.0 * log2(num / den);
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+int kbm_load(char *path, kbm_t *k) {
+    char line[256];
+    int v[6];
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    // size, first, last, middle, reference key, frequency, octave degree
+    for (int i = 0; i < 7; i++) {
+        if (scl_line(line, sizeof(line), f) == NULL) {
+            fprintf(stderr, "%s: short header\n", path);
+            fclose(f);
+            return -1;
+        }
+        if (i == 5) k->freq = strtod(line, NULL);
+        else v[i < 5 ? i : 5] = atoi(line);
+    }
+    k->size = v[0];
+    k->first = v[1];
+    k->last = v[2];
+    k->middle = v[3];
+    k->ref = v[4];
+    k->octave = v[5];
+    if (k->size < 0 || k->size > 128 || k->freq <= 0) {
+        fprintf(stderr, "%s: bad mapping\n", path);
+        fclose(f);
+        return -1;
+    }
+    // missing entries are unmapped
+    for (int i = 0; i < k->size; i++) {
+        char *s = scl_line(line, sizeof(line), f);
+        s = s ? s + strspn(s, " \t") : NULL;
+        k->map[i] = s && *s >= '0' && *s <= '9' ? atoi(s) : -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+int floor_div(int a, int b) {
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+double degree_cents(double *cents, int n, int d) {
+    int o = floor_div(d, n);
+    int r = d - o * n;
+    return o * cents[n - 1] + (r ? cents[r - 1] : 0.0);
+}
+
+// cents of key relative to degree 0, NAN when unmapped
+double key_cents(double *cents, int n, kbm_t *k, int key) {
+    if (key < k->first || key > k->last) return NAN;
+    int d = key - k->middle;
+    if (k->size == 0) return degree_cents(cents, n, d);
+    int o = floor_div(d, k->size);
+    int m = k->map[d - o * k->size];
+    if (m < 0) return NAN;
+    return degree_cents(cents, n, m) + o * degree_cents(cents, n, k->octave ? k->octave : n);
+}
+
+// key to key interpolation is in pitch, an unmapped key is silent and the
+// key below one holds its pitch
+tuning_t *tuning_compile(char *name, double *cents, int n, kbm_t *k) {
+    double rc = key_cents(cents, n, k, k->ref);
+    if (isnan(rc)) {
+        fprintf(stderr, "%s: reference key %d unmapped\n", name, k->ref);
+        return NULL;
+    }
+    tuning_t *t = malloc(sizeof(tuning_t));
+    if (t == NULL) return NULL;
+    snprintf(t->name, sizeof(t->name), "%s", name);
+    double key[129];
+    for (int i = 0; i <= 128; i++) {
+        double f = k->freq * exp2((key_cents(cents, n, k, i) - rc) / 1200.0);
+        if (f > SAMPLE_RATE / 2) f = SAMPLE_RATE / 2;
+        key[i] = f * CYCLE_SIZE / SAMPLE_RATE * DDS_SCALE;  // NAN stays NAN
+    }
+    for (int i = 0; i <= 128 * PITCH_STEPS; i++) {
+        int j = i / PITCH_STEPS;
+        double a = key[j];
+        double b = j < 128 ? key[j + 1] : a;
+        double x = (double)(i % PITCH_STEPS) / PITCH_STEPS;
+        if (isnan(a)) t->inc[i] = 0;
+        else if (isnan(b) || x == 0) t->inc[i] = lrint(a);
+        else t->inc[i] = lrint(a * pow(b / a, x));
+    }
+    return t;
+}
+
+// free what the audio thread has let go of
+void tuning_reap(void) {
+    tuning_t *held = atomic_load(&tuning_held);
+    for (int i = 0; i < TUNING_RETIRED; i++) {
+        if (tuning_retired[i] && tuning_retired[i] != held) {
+            free(tuning_retired[i]);
+            tuning_retired[i] = NULL;
+        }
+    }
+}
+
+void tuning_set(tuning_t *t) {
+    tuning_t *old = atomic_exchange(&tuning, t);
+    if (old != &tuning_12tet) {
+        for (int i = 0; i < TUNING_RETIRED; i++) {
+            if (tuning_retired[i] == NULL) {
+                tuning_retired[i] = old;
+                old = NULL;
+                break;
+            }
+        }
+        // can't happen, only the held one outlives a reap
+        if (old) fprintf(stderr, "tuning %s leaked\n", old->name);
+    }
+    tuning_reap();
+}
+
+int tuning_load(char *scl, char *kbm) {
+    static double cents[SCL_MAX];
+    char desc[64];
+    int n = scl_load(scl, desc, sizeof(desc), cents);
+    if (n < 0) return -1;
+    kbm_t k = { .size = 0, .first = 0, .last = 127, .middle = 60, .ref = 60,
+        .freq = 261.6255653, .octave = n };
+    if (kbm && kbm_load(kbm, &k) != 0) return -1;
+    tuning_t *t = tuning_compile(desc[0] ? desc : scl, cents, n, &k);
+    if (t == NULL) return -1;
+    tuning_set(t);
+    printf("K %s: %d degrees, period %.2f cents\n", t->name, n, cents[n - 1]);
+    return 0;
+}
+
+// from synth(), take up a new tuning and retune the pitched voices to it
+void tuning_pickup(void) {
+    if (atomic_load_explicit(&tuning, memory_order_acquire) == tune) return;
+    tuning_t *t;
+    do {
+        t = atomic_load(&tuning);
+        atomic_store(&tuning_held, t);
+    } while (t != atomic_load(&tuning));
+    tune = t;
+    for (int i = 0; i < voices; i++) {
+        if (pool[i].op >= 0) voice_tune(&pool[i]);
+    }
+}
+
+int voice_idle(voice_t *v) {
+    if (v->oe) return v->env.stage == ENV_IDLE;
+    return v->oa == 0.0 || v->top == 0;
+}
+
+double voice_level(voice_t *v) {
+    if (v->oe) return v->oa * v->env.current_level / (double)ENV_SCALE;
+    return v->oa;
+}
+
+int voice_alloc(int note) {
+    int best = -1;
+    if (steal == STEAL_SAMENOTE) {
+        for (int i=0; i<voices; i++) {
+            if (pool[i].note == note) return i;
+        }
+    }
+    for (int i=0; i<voices; i++) {
+        voice_t *v = &pool[i];
+        if (v->ismod || !voice_idle(v)) continue;
+        // prefer the one that's been free longest
+        if (best < 0 || v->age < pool[best].age) best = i;
+    }
+    if (best >= 0) return best;
+    for (int i=0; i<voices; i++) {
+        voice_t *v = &pool[i];
+        if (v->ismod || v->note < 0) continue;
+        if (best < 0) {
+            best = i;
+        } else if (steal == STEAL_QUIETEST) {
+            if (voice_level(v) < voice_level(&pool[best])) best = i;
+        } else {
+            // releasing voices go before held ones
+            if (v->gate < pool[best].gate ||
+                (v->gate == pool[best].gate && v->age < pool[best].age)) best = i;
+        }
+    }
+    return best;
+}
+
+void voice_note_on(int patch, int note, double velocity) {
+    if (tune->inc[note * PITCH_STEPS] == 0) return;  // unmapped in this tuning
+    int i = voice_alloc(note);
+    if (i < 0) return;
+    voice_t *v = &pool[i];
+    voice_t *t = &pool[patch];
+    if (v != t) {
+        v->ow = t->ow;
+        v->oe = t->oe;
+        v->ofm = t->ofm;
+        v->ofg = t->ofg;
+        env_init(&v->env,
+            t->env.attack_ms, t->env.decay_ms, t->env.release_ms,
+            t->env.attack_level, t->env.sustain_level);
+    }
+    v->on = note;
+    v->note = note;
+    voice_pitch(v, note * PITCH_ONE);
+    v->oa = velocity;
+    calc_ratio(i);
+    env_on(&v->env);
+    v->gate = 1;
+    v->age = ++note_clock;
+}
+
+void voice_note_off(int note) {
+    for (int i=0; i<voices; i++) {
+        voice_t *v = &pool[i];
+        if (v->note != note || !v->gate) continue;
+        v->gate = 0;
+        if (v->oe) {
+            env_off(&v->env);
+        } else {
+            v->oa = 0.0;
+            calc_ratio(i);
+        }
+    }
+}
+
+long mytol(char *str, int *valid, int *next) {
+    long val;
+    char *endptr;
+    val = strtol(str, &endptr, 10);
+    if (endptr == str) {
+        if (valid) *valid = 0;
+        if (next) *next = 0;
+        return 0;
+    }
+    if (valid) *valid = 1;
+    if (next) *next = endptr - str + 1;
+    return val;
+}
+
+double mytod(char *str, int *valid, int *next) {
+    double val;
+    char *endptr;
+    val = strtod(str, &endptr);
+    if (endptr == str) {
+        if (valid) *valid = 0;
+        if (next) *next = 0;
+        return 0;
+    }
+    if (valid) *valid = 1;
+    if (next) *next = endptr - str + 1;
+    return val;
+}
+
+char *mytok(char *str, char tok, int *next) {
+    int n = 0;
+    while (1) {
+        if (str[n] == tok) {
+            str[n] = '\0';
+            if (next) *next = n+1;
+            return str;
+        }
+    }
+}
+
+// load meter: synth() logs its time against the period deadline into a
+// ring and every thread registers its cpu clock. Reading either is left to
+// the S command, the audio path only does a store.
+
+#define METER_RING (4096)
+#define METER_THREADS (72)  // the workers, audio, render, user and midi
+
+typedef struct {
+    char name[16];
+    clockid_t clock;
+    long cpu;   // thread cpu time at the last S
+    long wall;
+} meter_thread_t;
+
+uint32_t meter_load[METER_RING];  // synth time per period, 1/10000 of the deadline
+atomic_uint meter_n;
+meter_thread_t meter_threads[METER_THREADS];
+atomic_int meter_nthreads;
+
+long clock_ns(clockid_t clock) {
+    struct timespec ts;
+    if (clock_gettime(clock, &ts) != 0) return 0;
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// called by each thread on itself
+void meter_thread(char *name) {
+    trace_thread(name);
+    log_thread();
+    int k = atomic_fetch_add(&meter_nthreads, 1);
+    if (k >= METER_THREADS) return;
+    meter_thread_t *t = &meter_threads[k];
+    snprintf(t->name, sizeof(t->name), "%s", name);
+    if (pthread_getcpuclockid(pthread_self(), &t->clock) != 0) t->clock = CLOCK_THREAD_CPUTIME_ID;
+    t->cpu = clock_ns(t->clock);
+    t->wall = clock_ns(CLOCK_MONOTONIC);
+}
+
+void meter_period(long ns, int frames) {
+    unsigned n = atomic_load_explicit(&meter_n, memory_order_relaxed);
+    meter_load[n % METER_RING] = ns * SAMPLE_RATE / ((long)frames * 100000);
+    atomic_store_explicit(&meter_n, n + 1, memory_order_release);
+}
+
+int meter_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+void meter_show(void) {
+    static uint32_t load[METER_RING];
+    unsigned n = atomic_load_explicit(&meter_n, memory_order_acquire);
+    unsigned count = n < METER_RING ? n : METER_RING;
+    for (unsigned i = 0; i < count; i++) load[i] = meter_load[(n - count + i) % METER_RING];
+    if (count > 0) {
+        qsort(load, count, sizeof(load[0]), meter_cmp);
+        uint64_t sum = 0;
+        for (unsigned i = 0; i < count; i++) sum += load[i];
+        printf("dsp min %.1f%% avg %.1f%% max %.1f%% p99 %.1f%% over %u periods, late %lu\n",
+            load[0] / 100.0, sum / 100.0 / count, load[count - 1] / 100.0,
+            load[count * 99 / 100] / 100.0, count, sched_late);
+    }
+    int threads = atomic_load(&meter_nthreads);
+    if (threads > METER_THREADS) threads = METER_THREADS;
+    for (int k = 0; k < threads; k++) {
+        meter_thread_t *t = &meter_threads[k];
+        long cpu = clock_ns(t->clock);
+        long wall = clock_ns(CLOCK_MONOTONIC);
+        if (wall > t->wall) printf("%s cpu %.1f%%\n", t->name, (cpu - t->cpu) * 100.0 / (wall - t->wall));
+        t->cpu = cpu;
+        t->wall = wall;
+    }
+}
+
+// period statistics: log2 histograms of synth time, time spent waiting
+// for the backend and output delay, plus a log of xruns. Each has a single
+// writer and readers take what they get. ?? summarises, H dumps them.
+
+#define HIST_BINS (24)  // bin b counts values under 2^b us
+#define XRUN_LOG (64)
+
+typedef struct {
+    char *name;
+    atomic_ulong bin[HIST_BINS];
+    atomic_ulong n;
+    atomic_ulong max;
+} hist_t;
+
+hist_t hist_synth = { "synth" };
+hist_t hist_wait = { "wait" };
+hist_t hist_delay = { "delay" };
+hist_t *hists[] = { &hist_synth, &hist_wait, &hist_delay };
+
+typedef struct {
+    long at;          // CLOCK_MONOTONIC ns
+    uint64_t sent;    // frames sent when it happened
+    int err;
+} xrun_t;
+
+xrun_t xrun_log[XRUN_LOG];
+atomic_uint xrun_n;
+long stats_t0;
+
+#define BUMP(a, v) atomic_store_explicit(&(a), \
+    atomic_load_explicit(&(a), memory_order_relaxed) + (v), memory_order_relaxed)
+
+void hist_add(hist_t *h, long us) {
+    if (us < 0) us = 0;
+    int b = us ? 64 - __builtin_clzl(us) : 0;
+    if (b >= HIST_BINS) b = HIST_BINS - 1;
+    BUMP(h->bin[b], 1);
+    BUMP(h->n, 1);
+    if ((unsigned long)us > atomic_load_explicit(&h->max, memory_order_relaxed))
+        atomic_store_explicit(&h->max, us, memory_order_relaxed);
+}
+
+// upper bound of the bin holding the q-th fraction
+long hist_at(hist_t *h, double q) {
+    unsigned long n = atomic_load_explicit(&h->n, memory_order_relaxed);
+    unsigned long want = n * q;
+    unsigned long seen = 0;
+    for (int b = 0; b < HIST_BINS; b++) {
+        seen += atomic_load_explicit(&h->bin[b], memory_order_relaxed);
+        if (seen > want) return 1L << b;
+    }
+    return 1L << (HIST_BINS - 1);
+}
+
+void xrun_note(int err) {
+    unsigned n = atomic_load_explicit(&xrun_n, memory_order_relaxed);
+    xrun_t *x = &xrun_log[n % XRUN_LOG];
+    x->at = clock_ns(CLOCK_MONOTONIC);
+    x->sent = sent;
+    x->err = err;
+    atomic_store_explicit(&xrun_n, n + 1, memory_order_release);
+    trace("xrun", 'i', err);
+}
+
+void stats_show(int all) {
+    if (all) {
+        for (int k = 0; k < sizeof(hists) / sizeof(hists[0]); k++) {
+            hist_t *h = hists[k];
+            printf("%s p50 <%ldus p99 <%ldus max %luus over %lu\n", h->name,
+                hist_at(h, 0.5), hist_at(h, 0.99), atomic_load(&h->max), atomic_load(&h->n));
+        }
+    } else {
+        printf("synth p99 <%ldus wait p99 <%ldus delay p99 <%ldus",
+            hist_at(&hist_synth, 0.99), hist_at(&hist_wait, 0.99), hist_at(&hist_delay, 0.99));
+    }
+    unsigned n = atomic_load_explicit(&xrun_n, memory_order_acquire);
+    if (n > 0) {
+        xrun_t *x = &xrun_log[(n - 1) % XRUN_LOG];
+        printf("%sxruns %u, last at %.3fs frame %llu\n", all ? "" : " ",
+            n, (x->at - stats_t0) / 1e9, (unsigned long long)x->sent);
+    } else if (!all) {
+        puts("");
+    }
+}
+
+void stats_dump(void) {
+    char template[] = "statsXXXXXX";
+    int fd = mkstemp(template);
+    if (fd < 0) {
+        puts("FAIL");
+        perror("mkstemp");
+        return;
+    }
+    FILE *f = fdopen(fd, "w");
+    for (int k = 0; k < sizeof(hists) / sizeof(hists[0]); k++) {
+        hist_t *h = hists[k];
+        fprintf(f, "# %s us: below count\n", h->name);
+        for (int b = 0; b < HIST_BINS; b++) {
+            unsigned long c = atomic_load_explicit(&h->bin[b], memory_order_relaxed);
+            if (c) fprintf(f, "%s %ld %lu\n", h->name, 1L << b, c);
+        }
+    }
+    unsigned n = atomic_load_explicit(&xrun_n, memory_order_acquire);
+    fprintf(f, "# xrun: seconds frame error\n");
+    for (unsigned i = n > XRUN_LOG ? n - XRUN_LOG : 0; i < n; i++) {
+        xrun_t *x = &xrun_log[i % XRUN_LOG];
+        fprintf(f, "xrun %.6f %llu %d\n", (x->at - stats_t0) / 1e9, (unsigned long long)x->sent, x->err);
+    }
+    fclose(f);
+    printf("created %s\n", template);
+}
+
+// profiler: hardware counters around the render stages, P1 starts it,
+// P0 stops it, P reports. Each thread opens its own counter group the
+// first time it passes a probe with profiling on and reads the group at
+// each stage boundary. It costs a syscall per probe, so it is opt-in.
+
+enum { PROF_OSC, PROF_ENV, PROF_MIX, PROF_OUT, PROF_STAGES };
+char *prof_stage_names[] = { "osc", "env", "mix", "out" };
+
+#define PROF_EVENTS (5)
+struct {
+    char *name;
+    uint32_t type;
+    uint64_t config;
+} prof_events[PROF_EVENTS] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instr", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "l1d-miss", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+        | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+    { "llc-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "br-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+typedef struct {
+    unsigned long calls;
+    unsigned long frames;
+    uint64_t ev[PROF_EVENTS];
+} prof_count_t;
+
+typedef struct {
+    int fd;                 // group leader, -1 when nothing opened
+    int err;                // errno from the leader when it failed
+    int n;                  // events in the group
+    int slot[PROF_EVENTS];  // group position of each event, -1 if missing
+    prof_count_t stage[PROF_STAGES];
+} prof_t;
+
+atomic_int prof_on;
+prof_t prof[METER_THREADS];
+atomic_int prof_nthreads;
+prof_count_t prof_voice[VOICES_MAX];
+_Thread_local prof_t *prof_self;
+
+int prof_open(void) {
+    int k = atomic_fetch_add(&prof_nthreads, 1);
+    if (k >= METER_THREADS) return -1;
+    prof_t *p = &prof[k];
+    p->fd = -1;
+    for (int e = 0; e < PROF_EVENTS; e++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = prof_events[e].type;
+        attr.config = prof_events[e].config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, p->fd, 0);
+        p->slot[e] = -1;
+        if (fd < 0) {
+            if (p->fd < 0) p->err = errno;
+            continue;
+        }
+        if (p->fd < 0) p->fd = fd;
+        p->slot[e] = p->n++;
+    }
+    prof_self = p;
+    return p->fd < 0 ? -1 : 0;
+}
+
+void prof_read(uint64_t *ev) {
+    uint64_t group[1 + PROF_EVENTS];
+    if (read(prof_self->fd, group, sizeof(group)) < 0) return;
+    for (int e = 0; e < PROF_EVENTS; e++) {
+        int s = prof_self->slot[e];
+        ev[e] = s < 0 ? 0 : group[1 + s];
+    }
+}
+
+// start a run of stages, returns 0 when not profiling
+int prof_mark(uint64_t *ev) {
+    if (!atomic_load_explicit(&prof_on, memory_order_relaxed)) return 0;
+    if (prof_self == NULL) prof_open();
+    if (prof_self == NULL || prof_self->fd < 0) return 0;
+    prof_read(ev);
+    return 1;
+}
+
+// charge everything since the mark to a stage (and a voice), and move the mark
+void prof_stage(int stage, int voice, int frames, uint64_t *ev) {
+    uint64_t now[PROF_EVENTS];
+    prof_read(now);
+    prof_count_t *c = &prof_self->stage[stage];
+    prof_count_t *vc = voice >= 0 ? &prof_voice[voice] : NULL;
+    c->calls++;
+    c->frames += frames;
+    if (vc && stage == PROF_OSC) {
+        vc->calls++;
+        vc->frames += frames;
+    }
+    for (int e = 0; e < PROF_EVENTS; e++) {
+        uint64_t d = now[e] - ev[e];
+        c->ev[e] += d;
+        if (vc) vc->ev[e] += d;
+        ev[e] = now[e];
+    }
+}
+
+void prof_reset(void) {
+    int threads = atomic_load(&prof_nthreads);
+    if (threads > METER_THREADS) threads = METER_THREADS;
+    for (int k = 0; k < threads; k++) memset(prof[k].stage, 0, sizeof(prof[k].stage));
+    memset(prof_voice, 0, sizeof(prof_voice));
+}
+
+void prof_line(char *name, prof_count_t *c) {
+    double f = c->frames ? c->frames : 1;
+    printf("%-6s %8lu %6.1f", name, c->calls, c->ev[0] / f);
+    printf(" %5.2f", c->ev[0] ? (double)c->ev[1] / c->ev[0] : 0.0);
+    for (int e = 2; e < PROF_EVENTS; e++) printf(" %8.3f", c->ev[e] / f);
+    puts("");
+}
+
+void prof_show(void) {
+    int threads = atomic_load(&prof_nthreads);
+    if (threads > METER_THREADS) threads = METER_THREADS;
+    if (threads == 0) {
+        puts("no profile, P1 to start");
+        return;
+    }
+    if (prof[0].fd < 0) {
+        printf("perf_event_open failed: %s"
+            " (check /proc/sys/kernel/perf_event_paranoid or CAP_PERFMON)\n", strerror(prof[0].err));
+        return;
+    }
+    for (int e = 0; e < PROF_EVENTS; e++)
+        if (prof[0].slot[e] < 0) printf("%s not counted\n", prof_events[e].name);
+    printf("stage     calls cyc/fr   ipc");
+    for (int e = 2; e < PROF_EVENTS; e++) printf(" %8s", prof_events[e].name);
+    puts("   (misses per frame)");
+    for (int s = 0; s < PROF_STAGES; s++) {
+        prof_count_t t;
+        memset(&t, 0, sizeof(t));
+        for (int k = 0; k < threads; k++) {
+            prof_count_t *c = &prof[k].stage[s];
+            t.calls += c->calls;
+            t.frames += c->frames;
+            for (int e = 0; e < PROF_EVENTS; e++) t.ev[e] += c->ev[e];
+        }
+        prof_line(prof_stage_names[s], &t);
+    }
+    char name[16];
+    for (int i = 0; i < voices; i++) {
+        if (prof_voice[i].calls == 0) continue;
+        sprintf(name, "v%d", i);
+        prof_line(name, &prof_voice[i]);
+    }
+}
+
+char *device = "default";
+
+// output backends
+// Everything the audio loop needs from an output: open it, how many frames
+// to hand it at a time, a write that blocks until the frames are taken, and
+// close. The device name picks one: "null" is a sink clocked by a timerfd
+// at the period rate, -o uses the file backend, anything else is ALSA.
+
+#include <sys/timerfd.h>
+
+typedef struct {
+    char *name;
+    int (*open)(char *device);
+    int (*write)(void *buffer, int frames);
+    void (*close)(void);
+    int period;
+    // zero copy, optional: begin hands out up to *frames of the device
+    // buffer to render into, commit passes them on
+    void *(*begin)(int *frames);
+    int (*commit)(int frames);
+} backend_t;
+
+unsigned long xruns = 0;
+
+void *alsa_begin(int *frames);
+int alsa_commit(int frames);
+
+backend_t alsa_backend;
+
+int alsa_open(char *device) {
+    if (setup_alsa(device) != 0) return -1;
+    alsa_backend.begin = pcm_mmap ? alsa_begin : NULL;
+    alsa_backend.commit = pcm_mmap ? alsa_commit : NULL;
+    printf("ALSA %s access\n", pcm_mmap ? "mmap" : "rw");
+    return 0;
+}
+
+int alsa_xrun(int err) {
+    if (err == -EPIPE || err == -ESTRPIPE) {
+        xruns++;
+        xrun_note(err);
+    }
+    if ((err = snd_pcm_recover(pcm_handle, err, 1)) < 0) {
+        return check_alsa_error(err, "PCM recover failed");
+    }
+    return 0;
+}
+
+// block until a period fits without going over the latency
+int alsa_room(void) {
+    if (latency != pcm_latency && alsa_latency(latency) < 0) latency = pcm_latency;
+    long t0 = clock_ns(CLOCK_MONOTONIC);
+    trace("wait", 'B', 0);
+    for (;;) {
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm_handle);
+        if (avail < 0) {
+            if (alsa_xrun(avail) < 0) return -1;
+            continue;
+        }
+        if (avail >= pcm_room) {
+            hist_add(&hist_wait, (clock_ns(CLOCK_MONOTONIC) - t0) / 1000);
+            trace("wait", 'E', 0);
+            return 0;
+        }
+        // short mmap stretches can leave it just under the start threshold
+        if (snd_pcm_state(pcm_handle) == SND_PCM_STATE_PREPARED) snd_pcm_start(pcm_handle);
+        int err = snd_pcm_wait(pcm_handle, 1000);
+        if (err < 0 && alsa_xrun(err) < 0) return -1;
+    }
+}
+
+void alsa_sent(int frames) {
+    sent += frames;
+    if (snd_pcm_delay(pcm_handle, &pcm_delay) < 0) pcm_delay = 0;
+    hist_add(&hist_delay, (long)pcm_delay * 1000000 / SAMPLE_RATE);
+}
+
+int alsa_write(void *buffer, int frames) {
+    if (alsa_room() < 0) return -1;
+    trace("write", 'B', frames);
+    snd_pcm_sframes_t done = snd_pcm_writei(pcm_handle, buffer, frames);
+    trace("write", 'E', 0);
+    if (done < 0) {
+        if (alsa_xrun(done) < 0) return -1;
+    } else {
+        alsa_sent(done);
+    }
+    return frames;
+}
+
+snd_pcm_uframes_t mmap_offset;
+
+// hand out the next stretch of the ring, it can be short where it wraps
+void *alsa_begin(int *frames) {
+    if (alsa_room() < 0) return NULL;
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t n = *frames;
+    int err = snd_pcm_mmap_begin(pcm_handle, &areas, &mmap_offset, &n);
+    if (err < 0) {
+        check_alsa_error(err, "PCM mmap begin failed");
+        return NULL;
+    }
+    *frames = n;
+    return (char *)areas[0].addr + (areas[0].first + mmap_offset * areas[0].step) / 8;
+}
+
+// A short commit is progress, not an xrun: the rest is still in the ring
+// where the next stretch begins, so take that stretch and commit it too.
+int alsa_commit(int frames) {
+    while (frames > 0) {
+        trace("write", 'B', frames);
+        snd_pcm_sframes_t done = snd_pcm_mmap_commit(pcm_handle, mmap_offset, frames);
+        trace("write", 'E', 0);
+        if (done < 0) return alsa_xrun(done) < 0 ? -1 : 0;
+        if (done == 0) break;
+        alsa_sent(done);
+        frames -= done;
+        if (frames == 0) break;
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t n = frames;
+        int err = snd_pcm_mmap_begin(pcm_handle, &areas, &mmap_offset, &n);
+        if (err < 0) return check_alsa_error(err, "PCM mmap begin failed");
+        if ((int)n < frames) frames = n;
+    }
+    return 0;
+}
+
+void alsa_close(void) {
+    snd_pcm_close(pcm_handle);
+}
+
+int null_fd = -1;
+
+int null_open(char *device) {
+    format_set(want_format >= 0 ? want_format : FMT_FLOAT);
+    null_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (null_fd < 0) {
+        perror("timerfd_create");
+        return -1;
+    }
+    long ns = (long)ALSA_BUFFER * 1000000000L / SAMPLE_RATE;
+    struct itimerspec its;
+    its.it_interval.tv_sec = ns / 1000000000L;
+    its.it_interval.tv_nsec = ns % 1000000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(null_fd, 0, &its, NULL) < 0) {
+        perror("timerfd_settime");
+        close(null_fd);
+        return -1;
+    }
+    return 0;
+}
+
+// wait for the next tick, more than one means we missed a period
+int null_write(void *buffer, int frames) {
+    uint64_t ticks;
+    long t0 = clock_ns(CLOCK_MONOTONIC);
+    trace("wait", 'B', 0);
+    if (read(null_fd, &ticks, sizeof(ticks)) != sizeof(ticks)) return -1;
+    trace("wait", 'E', 0);
+    hist_add(&hist_wait, (clock_ns(CLOCK_MONOTONIC) - t0) / 1000);
+    if (ticks > 1) {
+        xruns += ticks - 1;
+        xrun_note(-EPIPE);
+    }
+    sent += frames;
+    return frames;
+}
+
+void null_close(void) {
+    close(null_fd);
+}
+
+// file backend: a WAV file when the name ends in .wav, raw samples
+// otherwise, s16 unless -F asks for another format
+
+FILE *file_out;
+int file_wav;
+uint64_t file_frames;
+
+void put16(FILE *f, uint16_t v) {
+    fputc(v & 0xff, f);
+    fputc(v >> 8, f);
+}
+
+void put32(FILE *f, uint32_t v) {
+    put16(f, v & 0xffff);
+    put16(f, v >> 16);
+}
+
+void wav_header(FILE *f, uint32_t frames) {
+    uint32_t bytes = frames * out_bytes;
+    fwrite("RIFF", 1, 4, f);
+    put32(f, 36 + bytes);
+    fwrite("WAVEfmt ", 1, 8, f);
+    put32(f, 16);
+    put16(f, out_format == FMT_FLOAT ? 3 : 1);  // IEEE float or PCM
+    put16(f, 1);                // mono
+    put32(f, SAMPLE_RATE);
+    put32(f, SAMPLE_RATE * out_bytes);
+    put16(f, out_bytes);
+    put16(f, out_bytes * 8);
+    fwrite("data", 1, 4, f);
+    put32(f, bytes);
+}
+
+int file_open(char *name) {
+    if ((file_out = fopen(name, "wb")) == NULL) {
+        perror(name);
+        return -1;
+    }
+    format_set(want_format >= 0 ? want_format : FMT_S16);
+    size_t len = strlen(name);
+    file_wav = len > 4 && strcasecmp(name + len - 4, ".wav") == 0;
+    file_frames = 0;
+    if (file_wav) wav_header(file_out, 0);
+    return 0;
+}
+
+int file_write(void *buffer, int frames) {
+    if (fwrite(buffer, out_bytes, frames, file_out) != (size_t)frames) return -1;
+    file_frames += frames;
+    return frames;
+}
+
+void file_close(void) {
+    if (file_wav) {
+        fseek(file_out, 0, SEEK_SET);
+        wav_header(file_out, file_frames);
+    }
+    fclose(file_out);
+}
+
+backend_t alsa_backend = { "alsa", alsa_open, alsa_write, alsa_close, ALSA_BUFFER };
+backend_t null_backend = { "null", null_open, null_write, null_close, ALSA_BUFFER };
+backend_t file_backend = { "file", file_open, file_write, file_close, ALSA_BUFFER };
+
+backend_t *sink = &alsa_backend;
+
+// inspired by AMY :)
+#define SINE 0
+#define SQR  1
+#define SAWD 2
+#define SAWU 3
+#define TRI  4
+#define NOIZ 5
+#define USR0 6
+#define USR1 7
+#define USR2 8
+#define USR3 9
+#define USR4 10
+#define NONE 11
+
+void dump(sample_t *wave) {
+    int c = 0;
+    char template[] = "waveXXXXXX";
+    int fd = mkstemp(template);
+    if (fd < 0) {
+        puts("FAIL");
+        perror("mkstemp");
+        return;
+    }
+    printf("created %s\n", template);
+    char buf[80];
+    for (int i=0; i<CYCLE_SIZE; i++) {
+        sprintf(buf, "%d\n", wave[i]);
+        write(fd, buf, strlen(buf));
+    }
+    close(fd);
+}
+
+void show_voice(char flag, int i) {
+    voice_t *v = &pool[i];
+    printf("%c v%d w%d f%.4f e%d a%.4f",
+        flag, i, v->ow, dds_hz(v->oi), v->oe, v->oa);
+    // printf(" t%d b%d", v->top, v->bot);
+    if (v->ismod) printf(" M%d", v->ismod);
+    if (v->ofm >= 0) printf(" F%d", v->ofm);
+    if (v->oe) printf(" B%d,%d,%d,%d,%d",
+        v->env.attack_ms,
+        v->env.decay_ms,
+        v->env.release_ms,
+        v->env.attack_level,
+        v->env.sustain_level);
+    if (v->ofg) printf(" G%d", v->ofg);
+    if (v->op != v->opt) printf(" (gliding to %.2f)", (double)v->opt / PITCH_ONE);
+    if (v->note >= 0) printf(" N%d%s", v->note, v->gate ? "" : " (off)");
+    puts("");
+}
+
+// events: wire() parses, the audio thread applies
+// Commands that touch voice state become event_t records pushed through a
+// single-producer/single-consumer ring. synth() drains it into a queue
+// ordered by sample time and splits the period at each event, so all voice
+// state is owned by the audio thread and notes start on their sample.
+
+enum {
+    EV_MOD,     // M
+    EV_GLIDE,   // G
+    EV_FMOD,    // F
+    EV_ENV,     // B
+    EV_ENVON,   // e
+    EV_FREQ,    // f
+    EV_AMP,     // a
+    EV_WAVE,    // w
+    EV_NOTE,    // n
+    EV_TOP,     // t
+    EV_BOT,     // b
+    EV_LEVEL,   // l
+    EV_NOTEON,  // N, velocity 0 is note off
+    EV_STEAL,   // A
+    EV_CC,      // MIDI controller, arg[0] number, arg[1] value
+    EV_BEND,    // MIDI pitch bend, val in semitones
+    // wire() programs only, never posted
+    OP_VOICE,   // v
+    OP_WAIT,    // ~, arg[0] frames
+    OP_LOOP,    // *, arg[0] times back to arg[1]
+};
+
+typedef struct {
+    uint16_t op;
+    uint16_t voice;
+    int32_t arg[5];
+    double val;
+    uint64_t when;  // sample time, anything already past is applied right away
+    uint32_t seq;   // keeps events with the same time in order
+} event_t;
+
+#define EV_RING (1024) // must be a power of 2
+
+typedef struct {
+    _Alignas(64) atomic_uint head; // producer
+    _Alignas(64) atomic_uint tail; // consumer
+    event_t ev[EV_RING];
+} ev_ring_t;
+
+ev_ring_t ui_ring;
+ev_ring_t midi_ring;
+int midi_cc[128];
+
+atomic_ullong rendered; // frames rendered, where the next period starts
+uint64_t wire_at;       // stamp for events from the line being parsed
+int offline = 0;        // -o, script lines follow each other instead of the clock
+
+int ev_push(ev_ring_t *r, event_t *e) {
+    unsigned int h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned int t = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (h - t == EV_RING) return 0;
+    r->ev[h & (EV_RING - 1)] = *e;
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+    return 1;
+}
+
+int ev_pop(ev_ring_t *r, event_t *e) {
+    unsigned int t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned int h = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (t == h) return 0;
+    *e = r->ev[t & (EV_RING - 1)];
+    atomic_store_explicit(&r->tail, t + 1, memory_order_release);
+    return 1;
+}
+
+// user thread side, waits for room rather than dropping
+int offline_render(uint64_t until);
+void offline_room(void);
+uint64_t offline_frames;
+
+void post(event_t *e) {
+    e->when = wire_at;
+    while (!ev_push(&ui_ring, e) && running) {
+        // offline we are the audio thread too and make the room ourselves
+        if (offline) offline_room(); else usleep(1000);
+    }
+}
+
+void send(int op, int32_t a0, double val) {
+    event_t e = { .op = op, .voice = voice, .arg = { a0 }, .val = val };
+    post(&e);
+}
+
+void apply(event_t *e) {
+    int i = e->voice;
+    voice_t *v = &pool[i];
+    switch (e->op) {
+        case EV_MOD:
+            v->ismod = e->arg[0];
+            break;
+        case EV_GLIDE:
+            v->ofg = e->arg[0];
+            break;
+        case EV_FMOD:
+            v->ofm = e->arg[0];
+            if (v->ofm >= 0) pool[v->ofm].ismod = 1;
+            break;
+        case EV_ENV:
+            env_init(&v->env, e->arg[0], e->arg[1], e->arg[2], e->arg[3], e->arg[4]);
+            break;
+        case EV_ENVON:
+            v->oe = e->arg[0];
+            break;
+        case EV_FREQ:
+            // a plain frequency, for modulators below the note range too
+            v->op = v->opt = -1;
+            v->oi = e->arg[0];
+            v->dds.phase_increment = v->oi;
+            break;
+        case EV_AMP:
+            v->oa = e->val;
+            calc_ratio(i);
+            break;
+        case EV_WAVE:
+            v->ow = e->arg[0];
+            break;
+        case EV_NOTE:
+            v->on = e->val;
+            voice_pitch(v, e->arg[0]);
+            break;
+        case EV_TOP:
+            v->top = e->arg[0];
+            if (v->bot > 0) v->oa = (double)v->top/(double)v->bot;
+            break;
+        case EV_BOT:
+            v->bot = e->arg[0];
+            if (v->bot > 0) v->oa = (double)v->top/(double)v->bot;
+            break;
+        case EV_LEVEL:
+            if (e->val <= 0.0) {
+                if (v->oe) {
+                    env_off(&v->env);
+                } else {
+                    v->oa = 0.0;
+                    calc_ratio(i);
+                }
+            } else {
+                v->oa = e->val;
+                calc_ratio(i);
+                env_on(&v->env);
+            }
+            break;
+        case EV_NOTEON:
+            if (e->val > 0.0) {
+                voice_note_on(i, e->arg[0], e->val);
+            } else {
+                voice_note_off(e->arg[0]);
+            }
+            break;
+        case EV_STEAL:
+            steal = e->arg[0];
+            break;
+        case EV_CC:
+            midi_cc[e->arg[0]] = e->arg[1];
+            // all sound off, all notes off
+            if (e->arg[0] == 120 || e->arg[0] == 123) {
+                for (int k = 0; k < voices; k++) {
+                    if (pool[k].note >= 0 && pool[k].gate) voice_note_off(pool[k].note);
+                }
+            }
+            break;
+        case EV_BEND:
+            bend = e->arg[0];
+            for (int k = 0; k < voices; k++) {
+                voice_t *b = &pool[k];
+                if (b->note >= 0 && b->op >= 0) voice_tune(b);
+            }
+            break;
+    }
+}
+
+// time ordered queue, a binary heap only the audio thread touches
+
+#define EV_QUEUE (4096)
+
+event_t evq[EV_QUEUE];
+int evq_n;
+uint32_t evq_seq;
+
+int ev_before(event_t *a, event_t *b) {
+    if (a->when != b->when) return a->when < b->when;
+    return (int32_t)(a->seq - b->seq) < 0;
+}
+
+void evq_push(event_t *e) {
+    int i = evq_n++;
+    e->seq = evq_seq++;
+    while (i > 0) {
+        int up = (i - 1) / 2;
+        if (!ev_before(e, &evq[up])) break;
+        evq[i] = evq[up];
+        i = up;
+    }
+    evq[i] = *e;
+}
+
+void evq_pop(event_t *e) {
+    *e = evq[0];
+    event_t last = evq[--evq_n];
+    int i = 0;
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= evq_n) break;
+        if (c + 1 < evq_n && ev_before(&evq[c + 1], &evq[c])) c++;
+        if (!ev_before(&evq[c], &last)) break;
+        evq[i] = evq[c];
+        i = c;
+    }
+    evq[i] = last;
+}
+
+unsigned long evq_full;  // times the queue filled up
+int evq_held;
+
+// the queue is full, the rings and the song keep their events till it
+// drains, which holds their producers back
+void evq_hold(void) {
+    if (evq_held) return;
+    evq_held = 1;
+    evq_full++;
+    LOG(LOG_INFO, "event queue full (%d), holding events back", EV_QUEUE, 0, 0);
+}
+
+// move new events into the queue while it has room
+void evq_fill(void) {
+    event_t e;
+    while (evq_n < EV_QUEUE && (ev_pop(&ui_ring, &e) || ev_pop(&midi_ring, &e))) {
+        evq_push(&e);
+    }
+    if (evq_n < EV_QUEUE) evq_held = 0; else evq_hold();
+}
+
+// MIDI input, -M source: an ALSA rawmidi device, seq (or seq:client:port
+// to connect from one) for a sequencer port, or a FIFO, file or - for
+// stdin carrying raw MIDI bytes. The thread sleeps in poll() and parses
+// whatever arrives into events on midi_ring, stamped one period after
+// the arrival time so they keep their spacing.
+
+#define MIDI_BEND_RANGE (2.0) // semitones either way
+
+char *midi_source;
+snd_rawmidi_t *midi_raw;
+snd_seq_t *midi_seq;
+snd_midi_event_t *midi_dec;
+int midi_fd = -1;
+int midi_stdin = -1;  // stdin flags to put back
+int midi_wake = -1;  // eventfd to get the thread out of poll()
+unsigned long midi_msgs;
+unsigned long midi_drops;
+
+// where and when the period being rendered started, written by synth()
+// under a sequence count
+atomic_uint clock_seq;
+atomic_ullong clock_frames;
+atomic_long clock_at;
+
+void clock_stamp(uint64_t frames, long ns) {
+    unsigned s = atomic_load_explicit(&clock_seq, memory_order_relaxed);
+    atomic_store_explicit(&clock_seq, s + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&clock_frames, frames, memory_order_relaxed);
+    atomic_store_explicit(&clock_at, ns, memory_order_relaxed);
+    atomic_store_explicit(&clock_seq, s + 2, memory_order_release);
+}
+
+// the sample time for something that arrived at ns
+uint64_t clock_when(long ns) {
+    unsigned s;
+    uint64_t frames;
+    long at;
+    do {
+        s = atomic_load_explicit(&clock_seq, memory_order_acquire);
+        frames = atomic_load_explicit(&clock_frames, memory_order_relaxed);
+        at = atomic_load_explicit(&clock_at, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((s & 1) || s != atomic_load_explicit(&clock_seq, memory_order_relaxed));
+    long dt = ns > at ? ns - at : 0;
+    return frames + sink->period + (uint64_t)dt * SAMPLE_RATE / 1000000000L;
+}
+
+typedef struct {
+    uint8_t status;  // running status, 0 for none, 0xf0 inside sysex
+    uint8_t data[2];
+    uint8_t n;
+} midi_parser_t;
+
+// fill in the event for a channel message, 0 for the ones we ignore
+int midi_event(event_t *e, uint8_t status, uint8_t d0, uint8_t d1) {
+    e->voice = voice;
+    switch (status & 0xf0) {
+        case 0x90:
+            if (d1 > 0) {
+                e->op = EV_NOTEON;
+                e->arg[0] = d0;
+                e->val = d1 / 127.0;
+                break;
+            }
+            // fall through, velocity 0 is note off
+        case 0x80:
+            e->op = EV_NOTEON;
+            e->arg[0] = d0;
+            e->val = 0.0;
+            break;
+        case 0xb0:
+            e->op = EV_CC;
+            e->arg[0] = d0;
+            e->arg[1] = d1;
+            break;
+        case 0xe0:
+            e->op = EV_BEND;
+            e->val = (((d1 << 7) | d0) - 8192) / 8192.0 * MIDI_BEND_RANGE;
+            e->arg[0] = lrint(e->val * PITCH_ONE);
+            break;
+        default:
+            return 0;
+    }
+    return 1;
+}
+
+void midi_message(uint8_t status, uint8_t d0, uint8_t d1, long ns) {
+    event_t e = { .when = clock_when(ns) };
+    if (!midi_event(&e, status, d0, d1)) return;
+    midi_msgs++;
+    if (!ev_push(&midi_ring, &e)) midi_drops++;
+}
+
+void midi_byte(midi_parser_t *p, uint8_t b, long ns) {
+    if (b >= 0xf8) return;  // real time, leaves running status alone
+    if (b & 0x80) {
+        // system common and the end of sysex cancel running status
+        p->status = b < 0xf0 || b == 0xf0 ? b : 0;
+        p->n = 0;
+        return;
+    }
+    if (p->status == 0 || p->status == 0xf0) return;
+    p->data[p->n++] = b;
+    uint8_t kind = p->status & 0xf0;
+    if (p->n < (kind == 0xc0 || kind == 0xd0 ? 1 : 2)) return;
+    p->n = 0;
+    midi_message(p->status, p->data[0], p->data[1], ns);
+}
+
+int midi_open(char *source) {
+    int err;
+    midi_wake = eventfd(0, EFD_CLOEXEC);
+    if (source == NULL) return 0;
+    if (strcmp(source, "-") == 0) {
+        // non-blocking so only poll() waits, put back as it was at exit
+        midi_fd = 0;
+        midi_stdin = fcntl(0, F_GETFL);
+        if (midi_stdin >= 0) fcntl(0, F_SETFL, midi_stdin | O_NONBLOCK);
+    } else if (access(source, F_OK) == 0) {
+        // read-write so a FIFO doesn't hit end of file between writers
+        if ((midi_fd = open(source, O_RDWR | O_NONBLOCK)) < 0 &&
+            (midi_fd = open(source, O_RDONLY | O_NONBLOCK)) < 0) {
+            perror(source);
+            return -1;
+        }
+    } else if (strncmp(source, "seq", 3) == 0) {
+        if ((err = snd_seq_open(&midi_seq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK)) < 0) {
+            return check_alsa_error(err, "Cannot open sequencer");
+        }
+        snd_seq_set_client_name(midi_seq, "synth");
+        int port = snd_seq_create_simple_port(midi_seq, "synth in",
+            SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+            SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+        if (port < 0) return check_alsa_error(port, "Cannot create sequencer port");
+        if (source[3] == ':') {
+            snd_seq_addr_t from;
+            if ((err = snd_seq_parse_address(midi_seq, &from, source + 4)) < 0 ||
+                (err = snd_seq_connect_from(midi_seq, port, from.client, from.port)) < 0) {
+                return check_alsa_error(err, "Cannot connect sequencer port");
+            }
+        }
+        if ((err = snd_midi_event_new(256, &midi_dec)) < 0) {
+            return check_alsa_error(err, "Cannot make MIDI decoder");
+        }
+        snd_midi_event_no_status(midi_dec, 1);
+        printf("MIDI seq %d:%d\n", snd_seq_client_id(midi_seq), port);
+    } else {
+        if ((err = snd_rawmidi_open(&midi_raw, NULL, source, SND_RAWMIDI_NONBLOCK)) < 0) {
+            return check_alsa_error(err, "Cannot open rawmidi device");
+        }
+    }
+    midi_source = source;
+    return 0;
+}
+
+void *midi(void *arg) {
+    meter_thread("midi");
+    struct pollfd pfd[16];
+    int n = 0;
+    pfd[n++] = (struct pollfd){ .fd = midi_wake, .events = POLLIN };
+    int fdi = n;
+    if (midi_fd >= 0) pfd[n++] = (struct pollfd){ .fd = midi_fd, .events = POLLIN };
+    if (midi_raw) {
+        int c = snd_rawmidi_poll_descriptors(midi_raw, pfd + n, 16 - n);
+        if (c > 0) n += c;
+    }
+    if (midi_seq) {
+        int c = snd_seq_poll_descriptors(midi_seq, pfd + n, 16 - n, POLLIN);
+        if (c > 0) n += c;
+    }
+    midi_parser_t parser = { 0 };
+    uint8_t buf[256];
+    while (running) {
+        if (poll(pfd, n, -1) < 0 && errno != EINTR) break;
+        if (pfd[0].revents) break;
+        long ns = clock_ns(CLOCK_MONOTONIC);
+        if (midi_fd >= 0 && pfd[fdi].revents) {
+            ssize_t got;
+            while ((got = read(midi_fd, buf, sizeof(buf))) > 0) {
+                long at = clock_ns(CLOCK_MONOTONIC);
+                for (ssize_t k = 0; k < got; k++) midi_byte(&parser, buf[k], at);
+            }
+            if (got == 0 && midi_fd == 0) {
+                // end of stdin is the end of the session
+                running = 0;
+                break;
+            }
+            if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+                // a plain file stays readable at its end, stop polling it
+                close(midi_fd);
+                midi_fd = -1;
+                pfd[fdi].fd = -1;
+            }
+        }
+        if (midi_raw) {
+            ssize_t got;
+            while ((got = snd_rawmidi_read(midi_raw, buf, sizeof(buf))) > 0) {
+                for (ssize_t k = 0; k < got; k++) midi_byte(&parser, buf[k], ns);
+            }
+        }
+        if (midi_seq) {
+            snd_seq_event_t *ev;
+            while (snd_seq_event_input(midi_seq, &ev) >= 0) {
+                long got = snd_midi_event_decode(midi_dec, buf, sizeof(buf), ev);
+                for (long k = 0; k < got; k++) midi_byte(&parser, buf[k], ns);
+            }
+        }
+    }
+    if (midi_stdin >= 0) fcntl(0, F_SETFL, midi_stdin);
+    return NULL;
+}
+
+void midi_stop(void) {
+    uint64_t one = 1;
+    if (midi_wake >= 0) write(midi_wake, &one, sizeof(one));
+}
+
+// standard MIDI file player, -p song.mid
+// The file is read whole at startup. At the top of each period synth()
+// takes what falls due before its end: the tracks merge through a heap on
+// their next tick and the tempo map turns ticks into sample times as it
+// goes, so a song plays on the same samples live and offline.
+
+#define SMF_TRACKS (256)
+
+typedef struct {
+    const uint8_t *start;
+    const uint8_t *p;
+    const uint8_t *end;
+    uint64_t tick;   // of the next event
+    uint8_t status;  // running status
+} smf_track_t;
+
+char *smf_name;
+uint8_t *smf_data;
+size_t smf_size;
+int smf_format;
+int smf_division;  // ticks per quarter note, 0 for SMPTE time
+double smf_spt;    // samples per tick
+smf_track_t smf_tracks[SMF_TRACKS];
+int smf_ntracks;
+int smf_heap[SMF_TRACKS];
+int smf_heap_n;
+uint64_t smf_tempo_tick;  // the last tempo change
+double smf_tempo_at;      // and its sample
+uint64_t smf_start;       // sample time of tick 0
+int smf_started;
+uint64_t smf_end;         // length in samples
+unsigned long smf_notes;
+
+uint32_t smf_be(const uint8_t *p, int n) {
+    uint32_t v = 0;
+    while (n--) v = (v << 8) | *p++;
+    return v;
+}
+
+uint32_t smf_vlq(smf_track_t *t) {
+    uint32_t v = 0;
+    for (int n = 0; n < 4 && t->p < t->end; n++) {
+        uint8_t b = *t->p++;
+        v = (v << 7) | (b & 0x7f);
+        if (!(b & 0x80)) break;
+    }
+    return v;
+}
+
+// earlier tick first, track order among equals
+int smf_before(int a, int b) {
+    if (smf_tracks[a].tick != smf_tracks[b].tick) return smf_tracks[a].tick < smf_tracks[b].tick;
+    return a < b;
+}
+
+void smf_sift(int i) {
+    int k = smf_heap[i];
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= smf_heap_n) break;
+        if (c + 1 < smf_heap_n && smf_before(smf_heap[c + 1], smf_heap[c])) c++;
+        if (!smf_before(smf_heap[c], k)) break;
+        smf_heap[i] = smf_heap[c];
+        i = c;
+    }
+    smf_heap[i] = k;
+}
+
+double smf_sample(uint64_t tick) {
+    return smf_tempo_at + (tick - smf_tempo_tick) * smf_spt;
+}
+
+void smf_tempo(uint32_t us_per_quarter) {
+    if (smf_division == 0) return;  // SMPTE time ignores tempo
+    smf_spt = (double)us_per_quarter * SAMPLE_RATE / (1e6 * smf_division);
+}
+
+void smf_rewind(void) {
+    smf_heap_n = 0;
+    for (int k = 0; k < smf_ntracks; k++) {
+        smf_track_t *t = &smf_tracks[k];
+        t->p = t->start;
+        t->status = 0;
+        t->tick = smf_vlq(t);
+        if (t->p < t->end) smf_heap[smf_heap_n++] = k;
+    }
+    for (int i = smf_heap_n / 2 - 1; i >= 0; i--) smf_sift(i);
+    smf_tempo_tick = 0;
+    smf_tempo_at = 0;
+    smf_tempo(500000);
+    smf_started = 0;
+}
+
+// step over the next event of track t, 1 with a channel message in m.
+// A broken track just ends.
+int smf_event(smf_track_t *t, uint8_t *m) {
+    if (t->p >= t->end) goto broken;
+    uint8_t b = *t->p;
+    if (b & 0x80) t->p++;
+    else if ((b = t->status) == 0) goto broken;
+    if (b == 0xff) {
+        if (t->p >= t->end) goto broken;
+        uint8_t type = *t->p++;
+        uint32_t len = smf_vlq(t);
+        if (len > (size_t)(t->end - t->p)) goto broken;
+        if (type == 0x51 && len == 3) {
+            smf_tempo_at = smf_sample(t->tick);
+            smf_tempo_tick = t->tick;
+            smf_tempo(smf_be(t->p, 3));
+        }
+        t->p = type == 0x2f ? t->end : t->p + len;
+        return 0;
+    }
+    if (b == 0xf0 || b == 0xf7) {
+        uint32_t len = smf_vlq(t);
+        if (len > (size_t)(t->end - t->p)) goto broken;
+        t->p += len;
+        return 0;
+    }
+    if (b > 0xf0) goto broken;  // not allowed in a file
+    int n = (b & 0xe0) == 0xc0 ? 1 : 2;  // program and pressure take one
+    if (t->end - t->p < n) goto broken;
+    t->status = b;
+    m[0] = b;
+    m[1] = t->p[0] & 0x7f;
+    m[2] = n == 2 ? t->p[1] & 0x7f : 0;
+    t->p += n;
+    return 1;
+broken:
+    t->p = t->end;
+    return 0;
+}
+
+// play the song up to sample until from its start, queueing the events
+// when play is set
+void smf_run(uint64_t until, int play) {
+    while (smf_heap_n > 0) {
+        if (play && evq_n >= EV_QUEUE) {
+            // the rest waits for the next period
+            evq_hold();
+            break;
+        }
+        smf_track_t *t = &smf_tracks[smf_heap[0]];
+        double at = smf_sample(t->tick);
+        if (at >= until) break;
+        uint8_t m[3];
+        event_t e = { 0 };
+        if (smf_event(t, m) && midi_event(&e, m[0], m[1], m[2])) {
+            if (e.op == EV_NOTEON && e.val > 0) smf_notes++;
+            if (play) {
+                e.when = smf_start + (uint64_t)at;
+                evq_push(&e);
+            }
+        }
+        // a track truncated inside the delta ends there too
+        if (t->p < t->end) t->tick += smf_vlq(t);
+        if (t->p >= t->end) {
+            smf_heap[0] = smf_heap[--smf_heap_n];
+            if ((uint64_t)at > smf_end) smf_end = at;
+        }
+        if (smf_heap_n > 0) smf_sift(0);
+    }
+}
+
+// from synth(), everything due before sample until
+void smf_feed(uint64_t now, uint64_t until) {
+    if (smf_data == NULL) return;
+    if (!smf_started) {
+        smf_start = now;
+        smf_started = 1;
+    }
+    smf_run(until - smf_start, 1);
+}
+
+int smf_load(char *name) {
+    FILE *f = fopen(name, "rb");
+    if (f == NULL) {
+        perror(name);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *d = malloc(size > 0 ? size : 1);
+    if (d == NULL || size < 0 || fread(d, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "%s: can't read\n", name);
+        fclose(f);
+        free(d);
+        return -1;
+    }
+    fclose(f);
+    if (size < 14 || memcmp(d, "MThd", 4) != 0 || smf_be(d + 4, 4) < 6) {
+        fprintf(stderr, "%s: not a MIDI file\n", name);
+        free(d);
+        return -1;
+    }
+    smf_format = smf_be(d + 8, 2);
+    int division = smf_be(d + 12, 2);
+    size_t pos = 8 + (size_t)smf_be(d + 4, 4);
+    smf_ntracks = 0;
+    while (pos + 8 <= (size_t)size && smf_ntracks < SMF_TRACKS) {
+        size_t len = smf_be(d + pos + 4, 4);
+        if (len > size - pos - 8) len = size - pos - 8;
+        if (memcmp(d + pos, "MTrk", 4) == 0) {
+            smf_track_t *t = &smf_tracks[smf_ntracks++];
+            t->start = d + pos + 8;
+            t->end = t->start + len;
+        }
+        pos += 8 + len;
+    }
+    if (division & 0x8000) {
+        // frames per second and ticks per frame
+        int fps = -(int8_t)(division >> 8);
+        double rate = (fps == 29 ? 29.97 : fps) * (division & 0xff);
+        smf_division = 0;
+        smf_spt = rate > 0 ? SAMPLE_RATE / rate : 1;
+    } else {
+        smf_division = division ? division : 96;
+    }
+    smf_data = d;
+    smf_size = size;
+    smf_name = name;
+    // a dry run for the length and the note count
+    smf_rewind();
+    smf_run(UINT64_MAX, 0);
+    smf_rewind();
+    printf("SONG %s: type %d, %d tracks, %lu notes, %.2fs\n",
+        name, smf_format, smf_ntracks, smf_notes, (double)smf_end / SAMPLE_RATE);
+    return 0;
+}
+
+// compiled lines
+// wire() doesn't send events as it parses, it compiles them into a
+// program: the events with voice selects, waits and loops, which
+// wire_run() plays without looking at the text again. A line made only of
+// those commands is cached by its text, so replaying a script line costs a
+// hash lookup. Any other command runs the program so far and then itself,
+// as before, and keeps its line out of the cache.
+
+#define WIRE_OPS "vfnawlBGMFtbeNA~*"
+#define WIRE_PROG (512)
+#define WIRE_CACHE (256)
+#define WIRE_AHEAD (SAMPLE_RATE / 4)
+
+typedef struct {
+    uint16_t op;
+    int32_t arg[5];
+    double val;
+} insn_t;
+
+typedef struct {
+    uint32_t hash;
+    char *text;
+    insn_t *code;
+    int n;
+} wire_code_t;
+
+insn_t wire_prog[WIRE_PROG];
+int wire_n;
+int wire_loop;  // where a * goes back to
+int wire_pure;
+wire_code_t wire_cache[WIRE_CACHE];
+unsigned long wire_hits;
+unsigned long wire_misses;
+
+// loops post ahead as fast as they run, keep them to what the event queue
+// can hold
+void wire_pace(void) {
+    if (offline) {
+        if (wire_at > WIRE_AHEAD) offline_render(wire_at - WIRE_AHEAD);
+        return;
+    }
+    while (running && wire_at > atomic_load(&rendered) + WIRE_AHEAD) usleep(1000);
+}
+
+void wire_run(insn_t *code, int n) {
+    int left = 0;
+    for (int pc = 0; pc < n && running; pc++) {
+        insn_t *in = &code[pc];
+        switch (in->op) {
+            case OP_VOICE:
+                voice = in->arg[0];
+                break;
+            case OP_WAIT:
+                wire_at += in->arg[0];
+                break;
+            case OP_LOOP:
+                // loops don't nest, one count will do
+                if (left == 0) left = in->arg[0];
+                if (--left > 0) {
+                    pc = in->arg[1] - 1;
+                    wire_pace();
+                }
+                break;
+            default: {
+                event_t e = { .op = in->op, .voice = voice, .val = in->val };
+                memcpy(e.arg, in->arg, sizeof(e.arg));
+                post(&e);
+            }
+        }
+    }
+}
+
+// run what's compiled so far, the line can't be cached past this
+void wire_flush(void) {
+    wire_run(wire_prog, wire_n);
+    wire_n = 0;
+    wire_loop = 0;
+    wire_pure = 0;
+}
+
+insn_t *emit(int op, int32_t a0, double val) {
+    if (wire_n == WIRE_PROG) wire_flush();
+    insn_t *in = &wire_prog[wire_n++];
+    *in = (insn_t){ .op = op, .arg = { a0 }, .val = val };
+    return in;
+}
+
+uint32_t wire_hash(char *line) {
+    uint32_t h = 2166136261u;
+    while (*line) h = (h ^ (uint8_t)*line++) * 16777619u;
+    return h;
+}
+
+wire_code_t *wire_find(char *line, uint32_t h) {
+    wire_code_t *c = &wire_cache[h % WIRE_CACHE];
+    if (c->text && c->hash == h && strcmp(c->text, line) == 0) return c;
+    return NULL;
+}
+
+void wire_keep(char *line, uint32_t h) {
+    wire_code_t *c = &wire_cache[h % WIRE_CACHE];
+    insn_t *code = malloc(wire_n * sizeof(insn_t));
+    char *text = strdup(line);
+    if (code == NULL || text == NULL) {
+        free(code);
+        free(text);
+        return;
+    }
+    free(c->text);
+    free(c->code);
+    memcpy(code, wire_prog, wire_n * sizeof(insn_t));
+    *c = (wire_code_t){ .hash = h, .text = text, .code = code, .n = wire_n };
+}
+
+int wire(char *line) {
+    int p = 0;
+    int valid;
+    // the line starts where the last one left off, live no sooner than the
+    // next period boundary, so a ~ at the end of a line holds the next one
+    if (!offline) {
+        uint64_t next = atomic_load_explicit(&rendered, memory_order_acquire) + ALSA_BUFFER;
+        if (wire_at < next) wire_at = next;
+    }
+    uint32_t h = wire_hash(line);
+    wire_code_t *c = wire_find(line, h);
+    if (c) {
+        wire_hits++;
+        wire_run(c->code, c->n);
+        return 0;
+    }
+    wire_misses++;
+    wire_n = 0;
+    wire_loop = 0;
+    wire_pure = 1;
+    while (line[p] != '\0') {
+        valid = 1;
+        char c = line[p++];
+        int next;
+        if (c == ' ' || c == '\t' || c == '\r' || c == ';') continue;
+        if (c == '#') break;
+        if (strchr(WIRE_OPS, c) == NULL) wire_flush();
+        if (c == ':') {
+            char peek = line[p];
+            if (peek == 'c') {
+                p++;
+                printf("%c[2J%c[H\n", 27, 27);
+            } else if (peek == 'q') {
+                p++;
+                puts("");
+                running = 0;
+                return -1;
+            }
+        } else if (c == '~') {
+            // wait n ms: the rest of the line is stamped that much later
+            int ms = mytol(&line[p], &valid, &next);
+            if (!valid) break; else p += next-1;
+            if (ms > 0) emit(OP_WAIT, (int64_t)ms * SAMPLE_RATE / 1000, 0);
+        } else if (c == '?') {
+            char peek = line[p];
+            if (peek == '?') {
                 p++;
-                for (int i=0; i<VOICES; i++) {
+                for (int i=0; i<voices; i++) {
                     char flag = ' ';
                     if (i == voice) flag = '*';
                     show_voice(flag, i);
                 }
-                printf("rtms %ldms\n", rtms);
-                printf("btms %ldms\n", btms);
-                printf("diff %ldms\n", btms-rtms);
-                printf("L%d\n", latency_hack_ms);
-                printf("D%s\n", device);
+                printf("sent %llu delay %ldms\n", sent, (long)pcm_delay * 1000 / SAMPLE_RATE);
+                printf("A%d (%s)\n", steal, steal_names[steal]);
+                printf("K %s\n", atomic_load(&tuning)->name);
+                printf("workers %d levels %d render %ldus max %ldus late %lu\n",
+                    workers, sched_levels, sched_ns / 1000, sched_max_ns / 1000, sched_late);
+                if (pipe_depth) {
+                    printf("pipe %d low %u dry %lu\n", pipe_depth, pipe_low, pipe_dry);
+                    pipe_low = PIPE_MAX;
+                }
+                if (limit_la) {
+                    printf("limit %dms gain low %.3f\n", limit_la * 1000 / SAMPLE_RATE, limit_low);
+                    limit_low = 1.0f;
+                }
+                printf("L%d (%dms of %d periods)\n",
+                    latency, latency * ALSA_BUFFER * 1000 / SAMPLE_RATE, pcm_periods);
+                printf("D%s (%s %s) xruns %lu\n", device, sink->name, format_names[out_format], xruns);
+                printf("wire cache hits %lu misses %lu\n", wire_hits, wire_misses);
+                printf("events queued %d of %d, full %lu\n", evq_n, EV_QUEUE, evq_full);
+                if (midi_source) printf("MIDI %s messages %lu dropped %lu\n", midi_source, midi_msgs, midi_drops);
+                if (smf_data) {
+                    uint64_t at = atomic_load(&rendered);
+                    at = smf_started && at > smf_start ? at - smf_start : 0;
+                    printf("SONG %s %.1fs of %.1fs\n", smf_name,
+                        (double)at / SAMPLE_RATE, (double)smf_end / SAMPLE_RATE);
+                }
+                stats_show(1);
             } else {
                 int i = voice;
                 char flag = ' ';
                 if (i == voice) flag = '*';
                 show_voice(flag, i);
+                stats_show(0);
             }
             continue;
+        } else if (c == '*') {
+            // play the line so far, or since the last *, n times
+            int n = mytol(&line[p], &valid, &next);
+            if (!valid) break; else p += next-1;
+            if (n > 1) emit(OP_LOOP, n, 0)->arg[1] = wire_loop;
+            wire_loop = wire_n;
         } else if (c == 'M') {
             int m = mytol(&line[p], &valid, &next);
             if (!valid) break; else p += next-1;
-            ismod[voice] = m;
+            emit(EV_MOD, m, 0);
         } else if (c == 'G') {
             int g = mytol(&line[p], &valid, &next);
             if (!valid) break; else p += next-1;
-            ofg[voice] = g;
+            emit(EV_GLIDE, g, 0);
         } else if (c == 'S') {
-            cpu_usage("audio", audio_pid);
-            cpu_usage("user", user_pid);
-            cpu_usage("midi", midi_pid);
+            meter_show();
+        } else if (c == 'H') {
+            stats_dump();
+        } else if (c == 'V') {
+            int v = mytol(&line[p], &valid, &next);
+            if (!valid) break; else p += next-1;
+            atomic_store(&log_level, v);
+        } else if (c == 'T') {
+            if (line[p] >= '0' && line[p] <= '9') {
+                int on = mytol(&line[p], &valid, &next);
+                if (!valid) break; else p += next-1;
+                atomic_store(&trace_on, on != 0);
+            } else {
+                trace_dump();
+            }
+        } else if (c == 'K') {
+            // the rest of the line: nothing, 0 for equal temperament, or
+            // a scale and keyboard mapping
+            char *scl = strtok(&line[p], " \t");
+            char *kbm = scl ? strtok(NULL, " \t") : NULL;
+            if (scl == NULL) {
+                printf("K %s\n", atomic_load(&tuning)->name);
+            } else if (strcmp(scl, "0") == 0) {
+                tuning_set(&tuning_12tet);
+            } else {
+                tuning_load(scl, kbm);
+            }
+            break;
+        } else if (c == 'P') {
+            if (line[p] >= '0' && line[p] <= '9') {
+                int on = mytol(&line[p], &valid, &next);
+                if (!valid) break; else p += next-1;
+                if (on) prof_reset();
+                atomic_store(&prof_on, on != 0);
+            } else {
+                prof_show();
+            }
         } else if (c == 'F') {
             int f = mytol(&line[p], &valid, &next);
             if (!valid) break; else p += next-1;
-            if (f < VOICES) {
-                ofm[voice] = f;
-                ismod[f] = 1;
-            }
+            // F-1 takes the modulator off again
+            if (f >= -1 && f < voices) emit(EV_FMOD, f, 0);
         } else if (c == 'B') {
             // breakpoint aka ADR ... poor copy of AMY's
             // b#,#,#
@@ -660,15 +3054,19 @@ int wire(char *line) {
             if (!valid) break; else p += next-1;
 
             // use the values
-            env_init(&env[voice],a,d,r, al, sl);
+            insn_t *in = emit(EV_ENV, a, 0);
+            in->arg[1] = d;
+            in->arg[2] = r;
+            in->arg[3] = al;
+            in->arg[4] = sl;
         } else if (c == 'e') {
             char peek = line[p];
             if (peek == '0') {
                 p++;
-                oe[voice] = 0;
+                emit(EV_ENVON, 0, 0);
             } else if (peek == '1') {
                 p++;
-                oe[voice] = 1;
+                emit(EV_ENVON, 1, 0);
             } else {
                 continue;
             }
@@ -676,79 +3074,55 @@ int wire(char *line) {
             double f = mytod(&line[p], &valid, &next);
             // printf("freq :: p:%d :: f:%f valid:%d next:%d\n", p, f, valid, next);
             if (!valid) break; else p += next-1;
-            if (f >= 0.0) {
-                if (ofg[voice] > 0) {
-                    double d = f - of[voice];
-                    ofgd[voice] = d / (double)ofg[voice];
-                    oft[voice] = f;
-                    f += d;
-                    of[voice] = f;
-                    dds_freq(&dds[voice], f);
-                } else {
-                    of[voice] = f;
-                    dds_freq(&dds[voice], f);
-                }
-            }
+            if (f >= 0.0) emit(EV_FREQ, hz_inc(f), f);
         } else if (c == 'v') {
             int n = mytol(&line[p], &valid, &next);
             // printf("voice :: p:%d :: n:%d valid:%d next:%d\n", p, n, valid, next);
             if (!valid) break; else p += next-1;
-            if (n >= 0 && n < VOICES) voice = n;
+            if (n >= 0 && n < voices) emit(OP_VOICE, n, 0);
         } else if (c == 'a') {
             double a = mytod(&line[p], &valid, &next);
             // printf("amp :: p:%d :: a:%f valid:%d next:%d\n", p, a, valid, next);
             if (!valid) break; else p += next-1;
-            if (a >= 0.0) {
-                oa[voice] = a;
-                calc_ratio(voice);
-            }
+            if (a >= 0.0) emit(EV_AMP, 0, a);
         } else if (c == 'w') {
             int w = mytol(&line[p], &valid, &next);
             // printf("wave :: p:%d :: n:%d valid:%d next:%d\n", p, w, valid, next);
             if (!valid) break; else p += next-1;
-            if (w >= 0 && w < WAVE_MAX) {
-                ow[voice] = w;
-                sample_t *ptr = none;
-                switch (w) {
-                    case SINE: ptr = sine; break;
-                    case SQR: ptr = sqr; break;
-                    case SAWD: ptr = sawdown; break;
-                    case SAWU: ptr = sawup; break;
-                    case TRI: ptr = tri; break;
-                    case NOIZ: ptr = noise; break;
-                }
-            }
+            if (w >= 0 && w < WAVE_MAX) emit(EV_WAVE, w, 0);
         } else if (c == 'n') {
             double note = mytod(&line[p], &valid, &next);
             // printf("note :: p:%d :: note:%f valid:%d next:%d\n", p, note, valid, next);
             if (!valid) break; else p += next-1;
-            if (note >= 0.0 && note <= 127.0) {
-                on[voice] = note;
-                of[voice] = 440.0 * pow(2.0, (note - 69.0) / 12.0);
-                dds_freq(&dds[voice], of[voice]);
-            }
+            if (note >= 0.0 && note <= 127.0) emit(EV_NOTE, lrint(note * PITCH_ONE), note);
         } else if (c == 't') {
             int n = mytol(&line[p], &valid, &next);
             // printf("top :: p:%d :: n:%d valid:%d next:%d\n", p, n, valid, next);
             if (!valid) break; else p += next-1;
-            if (n >= 0) {
-                top[voice] = n;
-                if (bot[voice] > 0) oa[voice] = (double)top[voice]/(double)bot[voice];
-            }
+            if (n >= 0) emit(EV_TOP, n, 0);
         } else if (c == 'b') {
             int n = mytol(&line[p], &valid, &next);
             // printf("bot :: p:%d :: n:%d valid:%d next:%d\n", p, n, valid, next);
             if (!valid) break; else p += next-1;
-            if (n > 0) {
-                bot[voice] = n;
-                if (bot[voice] > 0) oa[voice] = (double)top[voice]/(double)bot[voice];
-            }
+            if (n > 0) emit(EV_BOT, n, 0);
+        } else if (c == 'N') {
+            // allocated note: N<note>,<velocity>, velocity 0 releases it
+            int note = mytol(&line[p], &valid, &next);
+            if (!valid) break; else p += next-1;
+            if (line[p] == ',') p++; else { valid = 0; break; }
+            double velocity = mytod(&line[p], &valid, &next);
+            if (!valid) break; else p += next-1;
+            if (note >= 0 && note <= 127) emit(EV_NOTEON, note, velocity);
+        } else if (c == 'A') {
+            int n = mytol(&line[p], &valid, &next);
+            if (!valid) break; else p += next-1;
+            if (n >= STEAL_OLDEST && n <= STEAL_SAMENOTE) emit(EV_STEAL, n, 0);
         } else if (c == 'L') {
             int n = mytol(&line[p], &valid, &next);
             // printf("LAT :: p:%d :: n:%d valid:%d next:%d\n", p, n, valid, next);
             if (!valid) break; else p += next-1;
             if (n > 0) {
-                latency_hack_ms = n;
+                latency = n;
             }
         } else if (c == 'W') {
             char peek = line[p];
@@ -774,23 +3148,14 @@ int wire(char *line) {
         } else if (c == 'l') {
             double velocity = mytod(&line[p], &valid, &next);
             if (!valid) break; else p += next-1;
-            if (velocity <= 0.0) {
-                if (oe[voice]) {
-                    env_off(&env[voice]);
-                } else {
-                    oa[voice] = 0.0;
-                    calc_ratio(voice);
-                }
-            } else if (velocity > 0.0) {
-                oa[voice] = velocity;
-                calc_ratio(voice);
-                env_on(&env[voice]);
-            }
+            emit(EV_LEVEL, 0, velocity);
         } else {
             valid = 0;
             break;
         }
     }
+    if (valid && wire_pure && wire_n > 0) wire_keep(line, h);
+    wire_flush();
     if (!valid) {
         printf("trouble -> %s\n", &line[p-1]);
     }
@@ -798,12 +3163,15 @@ int wire(char *line) {
 
 void *user(void *arg) {
     // int voice = 0;
-    user_pid = getpid();
+    meter_thread("user");
     while (1) {
         char *line = linenoise("> ");
         if (line == NULL) break;
         linenoiseHistoryAdd(line);
+        trace("wire", 'B', 0);
         int n = wire(line);
+        trace("wire", 'E', 0);
+        log_drain();
         linenoiseFree(line);
     }
     running = 0;
@@ -824,53 +3192,481 @@ sample_t *waves[WAVE_MAX] = {
     usr4,
 };
 
-void synth(int16_t *buffer, int period_size) {
-    int32_t a = 0;
-    int32_t b = 0;
-    for (int n = 0; n < period_size; n++) {
-        buffer[n] = 0;
-        int c = 0;
-        // process modulators first
-        for (int i=0; i<VOICES; i++) {
-            cachemod[i] = 0;
-            if (ow[i] == NONE) continue;
-            if (oa[i] == 0.0) continue;
-            if (top[i] == 0) continue;
-            if (ismod[i]) {
-                b = (dds_step(&dds[i], waves[ow[i]])) * top[i] / bot[i];
-                if (ofm[i] >= 0) {
-                    dds_freq(&dds[i], of[i] + (double)cachemod[ofm[i]]);
-                }
-                if (oe[i]) {
-                    int32_t envelope_value = env_next(&env[i]);
-                    int32_t sample = (b * envelope_value) >> ENV_FRAC_BITS;
-                    b = sample;
-                }
-                cachemod[i] = b;
-            }
+float silence[ALSA_BUFFER];
+
+// render voice i for the span into its buf with amplitude and envelope
+// applied, full scale is 1. sched_plan runs every modulator before what
+// it modulates, except a modulator reading one at a later level: that one
+// hasn't run yet and its buf still holds the previous span, which may be
+// shorter than this one, so past its end the modulation is zero.
+void render_voice(int i, int period_size) {
+    uint64_t ev[PROF_EVENTS];
+    int profiling = prof_mark(ev);
+    voice_t *v = &pool[i];
+    float *out = v->buf;
+    if (v->op != v->opt) voice_glide(v, period_size);
+    int m = v->ofm;
+    if (m >= 0) {
+        float *mod = silence;
+        int held = period_size;
+        if (m < voices && pool[m].ismod && pool[m].live) {
+            mod = pool[m].buf;
+            if (pool[m].lvl > v->lvl && pool[m].len < held) held = pool[m].len;
+        }
+        dds_render_block_fm(&v->dds, waves[v->ow], v->oi,
+            mod, out, held);
+        if (held < period_size)
+            dds_render_block_fm(&v->dds, waves[v->ow], v->oi,
+                silence, out + held, period_size - held);
+    } else {
+        dds_render_block(&v->dds, waves[v->ow], out, period_size);
+    }
+    if (profiling) prof_stage(PROF_OSC, i, period_size, ev);
+    // the tables are int16 full scale
+    float gain = v->oa * (1.0f / 32768);
+    if (v->op >= 0 && v->oi == 0) gain = 0.0f;  // on a key the tuning leaves out
+    if (v->oe) {
+        for (int n = 0; n < period_size; n++) out[n] *= gain * env_next(&v->env);
+    } else {
+        for (int n = 0; n < period_size; n++) out[n] *= gain;
+    }
+    v->len = period_size;
+    if (profiling) prof_stage(PROF_ENV, i, period_size, ev);
+}
+
+// render workers, -j N
+// Voices are rendered in dependency levels: a voice runs after every
+// modulator it reads this period, and a modulator that reads a later one
+// (so hears its previous period) runs before it. Within a level the
+// voices are spread over the shares by estimated cost, each share gets a
+// deque it pops from the front, and idle shares steal from the back of
+// the others. The audio thread is share 0; for each level it publishes
+// the work by bumping work_gen and waits for work_left to reach zero.
+// Carriers sum into the bus of whichever share rendered them.
+
+#define WORKERS_MAX (64)
+#define WORK_SPIN (2000)
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    int cpu;
+    unsigned int seen; // last work_gen handled
+    float *bus;
+    _Alignas(64) atomic_ullong range; // deque, first task << 32 | end
+} worker_t;
+
+worker_t worker[WORKERS_MAX + 1];
+atomic_uint work_gen;
+atomic_uint work_left;
+int work_period;
+int work_off;    // where this span starts in the period
+int work_first;  // first level of the span, shares clear their bus
+int *tasks;      // this level's voices grouped by share
+uint64_t load[WORKERS_MAX + 1];
+
+long futex(atomic_uint *addr, int op, unsigned int val) {
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#endif
+}
+
+long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// first guess before a voice has been timed
+uint32_t voice_cost(voice_t *v) {
+    uint32_t c = 1000;
+    if (v->ofm >= 0) c += 2000;
+    if (v->oe) c += 2000;
+    return c;
+}
+
+int task_pop(int k) {
+    unsigned long long r = atomic_load_explicit(&worker[k].range, memory_order_acquire);
+    while ((uint32_t)(r >> 32) < (uint32_t)r) {
+        unsigned long long next = r + (1ULL << 32);
+        if (atomic_compare_exchange_weak_explicit(&worker[k].range, &r, next,
+            memory_order_acq_rel, memory_order_acquire)) return tasks[r >> 32];
+    }
+    return -1;
+}
+
+int task_steal(int k) {
+    unsigned long long r = atomic_load_explicit(&worker[k].range, memory_order_acquire);
+    while ((uint32_t)(r >> 32) < (uint32_t)r) {
+        unsigned long long next = r - 1;
+        if (atomic_compare_exchange_weak_explicit(&worker[k].range, &r, next,
+            memory_order_acq_rel, memory_order_acquire)) return tasks[(uint32_t)next];
+    }
+    return -1;
+}
+
+void run_task(int k, int i, int period_size) {
+    voice_t *v = &pool[i];
+    long t0 = workers ? now_ns() : 0;
+    render_voice(i, period_size);
+    if (!v->ismod) {
+        float *bus = worker[k].bus + work_off;
+        float *out = v->buf;
+        for (int n = 0; n < period_size; n++) bus[n] += out[n];
+    }
+    if (workers) {
+        long dt = now_ns() - t0;
+        v->cost += ((int32_t)dt - (int32_t)v->cost) / 8;
+    }
+}
+
+void work(int k, int period_size) {
+    if (work_first) memset(worker[k].bus + work_off, 0, period_size * sizeof(float));
+    for (;;) {
+        int i = task_pop(k);
+        for (int j = 1; i < 0 && j <= workers; j++) {
+            i = task_steal((k + j) % (workers + 1));
+        }
+        if (i < 0) break;
+        run_task(k, i, period_size);
+    }
+}
+
+void *render_worker(void *arg) {
+    worker_t *w = arg;
+    char name[16];
+    sprintf(name, "worker %d", w->id);
+    meter_thread(name);
+    while (running) {
+        unsigned int gen;
+        int spin = 0;
+        while ((gen = atomic_load_explicit(&work_gen, memory_order_acquire)) == w->seen) {
+            if (++spin < WORK_SPIN) cpu_relax();
+            else futex(&work_gen, FUTEX_WAIT_PRIVATE, w->seen);
+        }
+        w->seen = gen;
+        work(w->id, work_period);
+        if (atomic_fetch_sub_explicit(&work_left, 1, memory_order_acq_rel) == 1) {
+            futex(&work_left, FUTEX_WAKE_PRIVATE, 1);
         }
-        // process things that are not modulators
-        for (int i=0; i<VOICES; i++) {
-            if (ismod[i]) continue;
-            if (ow[i] == NONE) continue;
-            if (oa[i] == 0.0) continue;
-            if (top[i] == 0) continue;
-            c++;
-            a = (dds_step(&dds[i], waves[ow[i]])) * top[i] / bot[i];
-            if (ofm[i] >= 0) {
-                dds_freq(&dds[i], of[i] + (double)cachemod[ofm[i]]);
+    }
+    return NULL;
+}
+
+int workers_init(int n) {
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    tasks = calloc(voices, sizeof(int));
+    if (tasks == NULL) return -1;
+    for (int k = 0; k <= n; k++) {
+        worker[k].id = k;
+        worker[k].bus = aligned_alloc(64, ALSA_BUFFER * sizeof(float));
+        if (worker[k].bus == NULL) return -1;
+    }
+    for (int i = 0; i < voices; i++) pool[i].cost = voice_cost(&pool[i]);
+    workers = n;
+    for (int k = 1; k <= n; k++) {
+        worker_t *w = &worker[k];
+        // leave the audio thread's cpu alone when there is more than one
+        int skip = rt_cpu >= 0 ? rt_cpu : 0;
+        w->cpu = 0;
+        if (ncpu > 1) {
+            w->cpu = (k - 1) % (ncpu - 1);
+            if (w->cpu >= skip) w->cpu++;
+        }
+        w->seen = atomic_load(&work_gen);
+        if (pthread_create(&w->thread, NULL, render_worker, w) != 0) {
+            workers = k - 1;
+            return -1;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if (pthread_setaffinity_np(w->thread, sizeof(set), &set) != 0) {
+            fprintf(stderr, "worker %d: cannot pin to cpu %d\n", k, w->cpu);
+        }
+        pthread_detach(w->thread);
+    }
+    return 0;
+}
+
+// level of each live voice, see above
+int sched_plan(void) {
+    int top = -1;
+    for (int i=0; i<voices; i++) pool[i].need = 0;
+    for (int i=0; i<voices; i++) {
+        voice_t *v = &pool[i];
+        if (!v->live || !v->ismod) continue;
+        v->lvl = v->need;
+        int m = v->ofm;
+        if (m >= 0 && m < voices && pool[m].live && pool[m].ismod) {
+            if (m < i) {
+                if (pool[m].lvl + 1 > v->lvl) v->lvl = pool[m].lvl + 1;
+            } else if (v->lvl + 1 > pool[m].need) {
+                pool[m].need = v->lvl + 1;
             }
-            if (oe[i]) {
-                int32_t envelope_value = env_next(&env[i]);
-                int32_t sample = (a * envelope_value) >> 2;
-                // int64_t sample = (a * envelope_value) >> ENV_FRAC_BITS;
-                buffer[n] += sample;
-            } else {
-                buffer[n] += a;
+        }
+        if (v->lvl > top) top = v->lvl;
+    }
+    for (int i=0; i<voices; i++) {
+        voice_t *v = &pool[i];
+        if (!v->live || v->ismod) continue;
+        v->lvl = 0;
+        int m = v->ofm;
+        if (m >= 0 && m < voices && pool[m].live && pool[m].ismod) v->lvl = pool[m].lvl + 1;
+        if (v->lvl > top) top = v->lvl;
+    }
+    return top + 1;
+}
+
+// spread one level over the shares, cheapest share first, and fill the deques
+int sched_level(int lvl) {
+    int count[WORKERS_MAX + 1];
+    int total = 0;
+    for (int k = 0; k <= workers; k++) {
+        load[k] = 0;
+        count[k] = 0;
+    }
+    for (int i=0; i<voices; i++) {
+        voice_t *v = &pool[i];
+        if (!v->live || v->lvl != lvl) continue;
+        int best = 0;
+        for (int k = 1; k <= workers; k++) {
+            if (load[k] < load[best]) best = k;
+        }
+        load[best] += v->cost;
+        count[best]++;
+        v->share = best;
+        total++;
+    }
+    int start[WORKERS_MAX + 1];
+    int at = 0;
+    for (int k = 0; k <= workers; k++) {
+        start[k] = at;
+        atomic_store_explicit(&worker[k].range,
+            ((unsigned long long)at << 32) | (at + count[k]), memory_order_relaxed);
+        at += count[k];
+    }
+    for (int i=0; i<voices; i++) {
+        voice_t *v = &pool[i];
+        if (!v->live || v->lvl != lvl) continue;
+        tasks[start[v->share]++] = i;
+    }
+    return total;
+}
+
+// render len samples into the buses starting at off
+void render(int off, int len) {
+    for (int i=0; i<voices; i++) {
+        voice_t *v = &pool[i];
+        v->live = 0;
+        if (v->ow == NONE) continue;
+        if (v->oa == 0.0) continue;
+        if (v->top == 0) continue;
+        v->live = 1;
+    }
+    sched_levels = sched_plan();
+    work_period = len;
+    work_off = off;
+    work_first = 1;
+    for (int lvl = 0; lvl < sched_levels || work_first; lvl++) {
+        int n = sched_level(lvl);
+        if (workers > 0 && (n > 1 || work_first)) {
+            atomic_store_explicit(&work_left, workers, memory_order_relaxed);
+            atomic_fetch_add_explicit(&work_gen, 1, memory_order_release);
+            futex(&work_gen, FUTEX_WAKE_PRIVATE, INT_MAX);
+            work(0, len);
+            unsigned int left;
+            int spin = 0;
+            while ((left = atomic_load_explicit(&work_left, memory_order_acquire)) != 0) {
+                if (++spin < WORK_SPIN) cpu_relax();
+                else futex(&work_left, FUTEX_WAIT_PRIVATE, left);
             }
+        } else {
+            work(0, len);
+        }
+        work_first = 0;
+    }
+}
+
+// output: voices sum into float buses, the mix optionally goes through
+// the limiter and convert() takes it to the device format, see format_set().
+
+// The limiter delays the mix by limit_la frames and keeps the running peak
+// of everything between the delayed frame and the newest one (a monotonic
+// deque), so the gain can start coming down before a peak reaches the
+// output. The gain ramps down in a straight line to reach the loudest
+// peak's target just as that peak gets to the delay tap, and recovers over
+// LIMIT_RELEASE seconds. A quieter peak ahead of it can still need less
+// than the ramp has reached, so the tap clamps to the ceiling as well.
+
+#define LIMIT_MAX (2048)
+#define LIMIT_CEIL (0.977f)  // about -0.2dB
+#define LIMIT_RELEASE (0.1)
+
+float limit_delay[LIMIT_MAX];
+float limit_peak[LIMIT_MAX];    // deque of falling peaks ...
+uint32_t limit_when[LIMIT_MAX]; // ... and the frame each was seen
+unsigned limit_head;
+unsigned limit_n;
+uint32_t limit_t;
+float limit_gain = 1.0f;
+float limit_release;
+
+void limit_init(int ms) {
+    limit_la = ms * SAMPLE_RATE / 1000;
+    if (limit_la >= LIMIT_MAX) limit_la = LIMIT_MAX - 1;
+    if (limit_la <= 0) {
+        limit_la = 0;
+        return;
+    }
+    limit_release = 1.0f - expf(-1.0f / (LIMIT_RELEASE * SAMPLE_RATE));
+}
+
+void limit(float *mix, int n) {
+    float g = limit_gain;
+    for (int i = 0; i < n; i++, limit_t++) {
+        float x = mix[i];
+        float a = fabsf(x);
+        while (limit_n > 0 && limit_peak[(limit_head + limit_n - 1) % LIMIT_MAX] <= a) limit_n--;
+        unsigned back = (limit_head + limit_n++) % LIMIT_MAX;
+        limit_peak[back] = a;
+        limit_when[back] = limit_t;
+        while (limit_t - limit_when[limit_head] > (uint32_t)limit_la) {
+            limit_head = (limit_head + 1) % LIMIT_MAX;
+            limit_n--;
+        }
+        float peak = limit_peak[limit_head];
+        float target = peak > LIMIT_CEIL ? LIMIT_CEIL / peak : 1.0f;
+        if (target < g) {
+            // frames until the peak is at the tap
+            uint32_t left = limit_la - (limit_t - limit_when[limit_head]);
+            g -= (g - target) / (left + 1);
+        } else {
+            g += (target - g) * limit_release;
+        }
+        float *d = &limit_delay[limit_t % limit_la];
+        float out = fabsf(*d);
+        if (out * g > LIMIT_CEIL) g = LIMIT_CEIL / out;
+        if (g < limit_low) limit_low = g;
+        mix[i] = *d * g;
+        *d = x;
+    }
+    limit_gain = g;
+}
+
+void synth(void *buffer, int period_size) {
+    trace("synth", 'B', period_size);
+    long t0 = now_ns();
+    uint64_t now = atomic_load_explicit(&rendered, memory_order_relaxed);
+    clock_stamp(now, t0);
+    tuning_pickup();
+    evq_fill();
+    smf_feed(now, now + period_size);
+    int pos = 0;
+    while (pos < period_size) {
+        event_t e;
+        while (evq_n > 0 && evq[0].when <= now + pos) {
+            evq_pop(&e);
+            apply(&e);
+        }
+        int len = period_size - pos;
+        if (evq_n > 0 && evq[0].when < now + period_size) len = evq[0].when - (now + pos);
+        render(pos, len);
+        pos += len;
+    }
+    uint64_t ev[PROF_EVENTS];
+    int profiling = prof_mark(ev);
+    float *mix = worker[0].bus;
+    for (int k = 1; k <= workers; k++) {
+        float *bus = worker[k].bus;
+        for (int n = 0; n < period_size; n++) mix[n] += bus[n];
+    }
+    if (limit_la) limit(mix, period_size);
+    convert(mix, buffer, period_size);
+    if (profiling) prof_stage(PROF_MIX, -1, period_size, ev);
+    atomic_store_explicit(&rendered, now + period_size, memory_order_release);
+    sched_ns = now_ns() - t0;
+    if (sched_ns > sched_max_ns) sched_max_ns = sched_ns;
+    if (sched_ns > (long)period_size * 1000000000L / SAMPLE_RATE) sched_late++;
+    meter_period(sched_ns, period_size);
+    hist_add(&hist_synth, sched_ns / 1000);
+    trace("synth", 'E', 0);
+}
+
+// the render half of the pipeline, it only stops when the audio thread
+// raises pipe_done and bumps the tail to wake it
+void *pipe_render(void *arg) {
+    meter_thread("render");
+    for (;;) {
+        unsigned tail = atomic_load_explicit(&pipe_tail, memory_order_acquire);
+        if (atomic_load(&pipe_done)) break;
+        unsigned head = atomic_load_explicit(&pipe_head, memory_order_relaxed);
+        if (head - tail >= (unsigned)pipe_depth) {
+            futex(&pipe_tail, FUTEX_WAIT_PRIVATE, tail);
+            continue;
         }
-        // buffer[n] /= c;
+        synth(pipe_buf + (head % pipe_depth) * sink->period * out_bytes, sink->period);
+        atomic_store_explicit(&pipe_head, head + 1, memory_order_release);
+        futex(&pipe_head, FUTEX_WAKE_PRIVATE, 1);
+    }
+    return NULL;
+}
+
+int pipe_init(int depth) {
+    if (depth > PIPE_MAX) depth = PIPE_MAX;
+    pipe_buf = aligned_alloc(64, depth * ALSA_BUFFER * out_bytes);
+    if (pipe_buf == NULL) return -1;
+    pipe_depth = depth;
+    if (pthread_create(&pipe_thread, NULL, pipe_render, NULL) != 0) {
+        pipe_depth = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void pipe_stop(void) {
+    atomic_store(&pipe_done, 1);
+    atomic_fetch_add(&pipe_tail, 1);
+    futex(&pipe_tail, FUTEX_WAKE_PRIVATE, 1);
+    pthread_join(pipe_thread, NULL);
+}
+
+// hand a rendered period to the backend, through its ring when it has one
+int sink_put(char *buffer, int frames) {
+    if (sink->begin == NULL) return sink->write(buffer, frames);
+    while (frames > 0) {
+        int n = frames;
+        void *ring = sink->begin(&n);
+        if (ring == NULL) return -1;
+        memcpy(ring, buffer, n * out_bytes);
+        if (sink->commit(n) < 0) return -1;
+        buffer += n * out_bytes;
+        frames -= n;
+    }
+    return 0;
+}
+
+// the audio half: take the oldest ready period, wait when there is none
+int pipe_feed(void) {
+    unsigned head = atomic_load_explicit(&pipe_head, memory_order_acquire);
+    unsigned tail = atomic_load_explicit(&pipe_tail, memory_order_relaxed);
+    if (head == tail) {
+        pipe_dry++;
+        futex(&pipe_head, FUTEX_WAIT_PRIVATE, head);
+        return 0;
     }
+    if (head - tail < pipe_low) pipe_low = head - tail;
+    uint64_t ev[PROF_EVENTS];
+    int profiling = prof_mark(ev);
+    if (sink_put(pipe_buf + (tail % pipe_depth) * sink->period * out_bytes, sink->period) < 0) return -1;
+    if (profiling) prof_stage(PROF_OUT, -1, sink->period, ev);
+    atomic_store_explicit(&pipe_tail, tail + 1, memory_order_release);
+    futex(&pipe_tail, FUTEX_WAKE_PRIVATE, 1);
+    return 0;
 }
 
 void listalsa(char *what) {
@@ -892,35 +3688,283 @@ void listalsa(char *what) {
     }
 }
 
+// real-time setup for the audio thread and the workers: SCHED_FIFO,
+// pinning, locked and pre-faulted memory. Whatever can't be had is
+// reported along with what would allow it, and we carry on without it.
+
+void prefault(void *p, size_t len) {
+    volatile char *c = p;
+    long page = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < len; i += page) c[i] = c[i];
+    if (len) c[len - 1] = c[len - 1];
+}
+
+void prefault_stack(void) {
+    char stack[256 * 1024];
+    memset(stack, 0, sizeof(stack));
+    __asm__ volatile("" : : "r"(stack) : "memory");
+}
+
+int rt_thread(pthread_t t, char *name, int cpu) {
+    int ok = 1;
+    struct sched_param sp = { .sched_priority = rt_prio };
+    int err = pthread_setschedparam(t, SCHED_FIFO, &sp);
+    if (err != 0) {
+        struct rlimit rl;
+        getrlimit(RLIMIT_RTPRIO, &rl);
+        fprintf(stderr, "RT %s: no SCHED_FIFO %d: %s"
+            " (RLIMIT_RTPRIO is %ld, needs CAP_SYS_NICE or rtprio >= %d)\n",
+            name, rt_prio, strerror(err), (long)rl.rlim_cur, rt_prio);
+        ok = 0;
+    }
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if ((err = pthread_setaffinity_np(t, sizeof(set), &set)) != 0) {
+            fprintf(stderr, "RT %s: cannot pin to cpu %d: %s\n", name, cpu, strerror(err));
+            ok = 0;
+        }
+    }
+    return ok;
+}
+
+void rt_setup(void) {
+    int ok = 1;
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        int err = errno;
+        struct rlimit rl;
+        getrlimit(RLIMIT_MEMLOCK, &rl);
+        fprintf(stderr, "RT: cannot lock memory: %s"
+            " (RLIMIT_MEMLOCK is %ld KB, needs CAP_IPC_LOCK or a higher memlock limit)\n",
+            strerror(err), (long)(rl.rlim_cur / 1024));
+        ok = 0;
+    }
+    // touch everything the audio path uses so it doesn't fault on first use
+    prefault(pool, pool_bytes);
+    for (int w = 0; w < WAVE_MAX; w++) prefault(waves[w], sizeof(sine));
+    prefault(cosine, sizeof(cosine));
+    prefault(&tuning_12tet, sizeof(tuning_12tet));
+    for (int k = 0; k <= workers; k++) prefault(worker[k].bus, ALSA_BUFFER * sizeof(float));
+    prefault(tasks, voices * sizeof(int));
+    prefault(evq, sizeof(evq));
+    prefault(&ui_ring, sizeof(ui_ring));
+    prefault(&midi_ring, sizeof(midi_ring));
+    if (smf_data) prefault(smf_data, smf_size);
+    if (pipe_depth) prefault(pipe_buf, pipe_depth * ALSA_BUFFER * out_bytes);
+    for (int k = 0; k < atomic_load(&trace_nthreads) && k < TRACE_THREADS; k++)
+        if (trace_rings[k].ev) prefault(trace_rings[k].ev, TRACE_RING * sizeof(trace_ev_t));
+    for (int k = 0; k < atomic_load(&log_nthreads) && k < LOG_THREADS; k++)
+        if (log_rings[k].rec) prefault(log_rings[k].rec, LOG_RING * sizeof(log_rec_t));
+    prefault_stack();
+
+    // with a pipeline the render thread gets the quiet cpu
+    ok &= rt_thread(pthread_self(), "audio", pipe_depth ? -1 : rt_cpu);
+    if (pipe_depth) ok &= rt_thread(pipe_thread, "render", rt_cpu);
+    char name[32];
+    for (int k = 1; k <= workers; k++) {
+        sprintf(name, "worker %d", k);
+        ok &= rt_thread(worker[k].thread, name, -1);
+    }
+    printf("RT SCHED_FIFO %d", rt_prio);
+    if (rt_cpu >= 0) printf(" cpu %d", rt_cpu);
+    printf(ok ? "\n" : " (partial, see above)\n");
+}
+
 #define HISTORY_FILE ".synth_history"
 
-int main(int argc, char *argv[]) {
-    int err;
-    int16_t buffer[ALSA_BUFFER];
+// offline rendering, -o file [-s script] [-t tail-seconds]
+// Script lines go through wire() back to back, each starting where the
+// previous one's ~ left off, and periods are rendered through the file
+// backend as fast as they can be up to the next line.
 
-    if (argc > 1) {
-        if (argv[1][0] == '-') {
-            if (argv[1][1] == 'a') {
-                listalsa("pcm");
-                return 0;
-            }
-            if (argv[1][1] == 'm') {
-                listalsa("rawmidi");
-                return 0;
-            }
+int offline_err;
+
+// whole periods up to sample until
+int offline_play(int frames) {
+    int32_t buffer[ALSA_BUFFER];  // room for a period in any format
+    synth(buffer, frames);
+    if (sink->write(buffer, frames) < 0) {
+        offline_err = errno ? errno : EIO;
+        running = 0;
+        return -1;
+    }
+    offline_frames += frames;
+    return 0;
+}
+
+int offline_render(uint64_t until) {
+    while (!offline_err && offline_frames + sink->period <= until) {
+        if (offline_play(sink->period) < 0) break;
+    }
+    log_drain();
+    return offline_err ? -1 : 0;
+}
+
+// the ring is full: queue what it holds, else play up to wire_at and no
+// further, or the event waiting on the ring would land late. Only a queue
+// full of events due right now makes it slip a frame.
+void offline_room(void) {
+    if (evq_n < EV_QUEUE) {
+        evq_fill();
+        return;
+    }
+    int n = 1;
+    if (wire_at > offline_frames) n = wire_at - offline_frames;
+    if (n > sink->period) n = sink->period;
+    offline_play(n);
+    log_drain();
+}
+
+int render_offline(char *out, char *script, double tail) {
+    FILE *in = stdin;
+    if (script && (in = fopen(script, "r")) == NULL) {
+        perror(script);
+        return 1;
+    }
+    if (script == NULL && smf_data) in = NULL;  // a song alone doesn't read commands
+    sink = &file_backend;
+    if (sink->open(out) != 0) return 1;
+
+    offline = 1;
+    wire_at = 0;
+    meter_thread("offline");
+    long t0 = now_ns();
+    char line[1024];
+    for (int done = 0; !done; ) {
+        uint64_t until;
+        if (running && in && fgets(line, sizeof(line), in)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            wire(line);
+            until = wire_at;
         } else {
-            device = argv[1];
+            until = (wire_at > smf_end ? wire_at : smf_end) + (uint64_t)(tail * SAMPLE_RATE);
+            done = 1;
+        }
+        // whole periods only, the next line may start inside the one after,
+        // and the last one rounds up
+        if (done) until += sink->period - 1;
+        if (offline_render(until) < 0) {
+            fprintf(stderr, "%s: %s\n", out, strerror(offline_err));
+            break;
         }
     }
+    long ns = now_ns() - t0;
+    sink->close();
+    if (in && in != stdin) fclose(in);
+    double secs = (double)offline_frames / SAMPLE_RATE;
+    printf("%s: %llu frames, %.2fs of audio in %.3fs (%.1fx realtime)\n",
+        out, (unsigned long long)offline_frames, secs, ns / 1e9, secs / (ns / 1e9));
+    return 0;
+}
 
-    if (setup_alsa(device) != 0) {
+int main(int argc, char *argv[]) {
+    int jobs = 0;
+    int depth = 0;
+    int limit_ms = 0;
+    char *midi_arg = NULL;
+    char *song = NULL;
+    char *out = NULL;
+    char *script = NULL;
+    double tail = 1.0;
+    int32_t buffer[ALSA_BUFFER];  // room for a period in any format
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            switch (argv[i][1]) {
+                case 'a':
+                    listalsa("pcm");
+                    return 0;
+                case 'm':
+                    listalsa("rawmidi");
+                    return 0;
+                case 'v':
+                    // voice count
+                    if (i + 1 < argc) voices = atoi(argv[++i]);
+                    break;
+                case 'j':
+                    // render worker threads
+                    if (i + 1 < argc) jobs = atoi(argv[++i]);
+                    break;
+                case 'o':
+                    // render offline to a file
+                    if (i + 1 < argc) out = argv[++i];
+                    break;
+                case 's':
+                    // script for -o, stdin otherwise
+                    if (i + 1 < argc) script = argv[++i];
+                    break;
+                case 't':
+                    // seconds rendered after the script ends
+                    if (i + 1 < argc) tail = atof(argv[++i]);
+                    break;
+                case 'P':
+                    // periods in the ALSA buffer
+                    if (i + 1 < argc) pcm_periods = atoi(argv[++i]);
+                    break;
+                case 'L':
+                    // periods of output latency
+                    if (i + 1 < argc) latency = atoi(argv[++i]);
+                    break;
+                case 'l':
+                    // limiter look-ahead in ms
+                    if (i + 1 < argc) limit_ms = atoi(argv[++i]);
+                    break;
+                case 'M':
+                    // MIDI input: rawmidi device, seq[:client:port], file or -
+                    if (i + 1 < argc) midi_arg = argv[++i];
+                    break;
+                case 'p':
+                    // MIDI file to play
+                    if (i + 1 < argc) song = argv[++i];
+                    break;
+                case 'F':
+                    // output format: s16, s32 or float
+                    if (i + 1 < argc && (want_format = format_parse(argv[++i])) < 0) {
+                        fprintf(stderr, "Unknown format %s (s16, s32, float)\n", argv[i]);
+                        return 1;
+                    }
+                    break;
+                case 'd':
+                    // periods rendered ahead by a separate thread
+                    if (i + 1 < argc) depth = atoi(argv[++i]);
+                    break;
+                case 'R':
+                    // real-time priority for the audio thread and workers
+                    if (i + 1 < argc) rt_prio = atoi(argv[++i]);
+                    break;
+                case 'C':
+                    // cpu for the audio thread
+                    if (i + 1 < argc) rt_cpu = atoi(argv[++i]);
+                    break;
+                default:
+                    fprintf(stderr, "usage: %s [-a] [-m] [-M midi] [-p song.mid] [-v voices] [-j workers]"
+                        " [-P periods] [-L latency] [-F format] [-d depth] [-l ms]"
+                        " [-R priority [-C cpu]]"
+                        " [-o out.wav [-s script] [-t tail]] [device]\n", argv[0]);
+                    return 1;
+            }
+        } else {
+            device = argv[i];
+        }
     }
 
-    linenoiseHistoryLoad(HISTORY_FILE);
+    if (voices < 1) voices = 1;
+    if (voices > VOICES_MAX) voices = VOICES_MAX;
+    if (voice_pool_init(voices) != 0) {
+        fprintf(stderr, "Cannot allocate %d voices\n", voices);
+        return 1;
+    }
 
     printf("DDS Q%d.%d\n", 32-DDS_FRAC_BITS, DDS_FRAC_BITS);
     printf("ENV Q%d.%d\n", 32-ENV_FRAC_BITS, ENV_FRAC_BITS);
 
+    dds_render_init();
+    printf("DDS kernel %s\n", dds_kernel_name);
+    limit_init(limit_ms);
+    if (limit_la) printf("LIMIT %d frames look-ahead\n", limit_la);
+
+    pitch_init();
     make_sine(sine, CYCLE_SIZE);
     make_cosine(cosine, CYCLE_SIZE);
     make_sqr(sqr, CYCLE_SIZE);
@@ -930,86 +3974,99 @@ int main(int argc, char *argv[]) {
     make_noise(noise, CYCLE_SIZE);
     make_none(none, CYCLE_SIZE);
 
-    for (int i=0; i<VOICES; i++) {
-        int mod = i+1;
-        of[i] = 440.0;
-        // of[mod] = 0.25;
-        ofm[i] = -1;
-        ismod[i] = 0;
-        dds_init(&dds[i], CYCLE_SIZE, of[i]);
-        ow[i] = SINE;
-        oa[i] = 0;
-        // dds_init(&dds[mod], CYCLE_SIZE, of[mod]);
-        // if (i < 4) {
-        //     ow[i] = SINE;
-        //     ow[mod] = SINE;
-        //     oa[i] = .01;
-        //     oa[mod] = 0;
-        // } else {
-        //     ow[i] = NONE;
-        //     ow[mod] = NONE;
-        //     oa[i] = 0;
-        //     oa[mod] = 0;
-        // }
+    for (int i=0; i<voices; i++) {
+        voice_t *v = &pool[i];
+        v->ofm = -1;
+        v->ismod = 0;
+        dds_init(&v->dds, CYCLE_SIZE, 440.0);
+        v->oi = v->dds.phase_increment;
+        v->op = v->opt = -1;
+        v->ow = SINE;
+        v->oa = 0;
         calc_ratio(i);
-        calc_ratio(mod);
-    }
-
-
-    for (int i=0; i<VOICES; i+=1) {
         // simple
-        env_init(&env[i], 
+        env_init(&v->env,
             2000,    // 2 second attack
             3000,    // 3 second decay
             4000,    // 4 second release
             ENV_SCALE, (ENV_SCALE * 7) / 10);
     }
+    printf("VOICES %d\n", voices);
+
+    if (jobs < 0) jobs = 0;
+    if (jobs > WORKERS_MAX) jobs = WORKERS_MAX;
+    if (workers_init(jobs) != 0) {
+        fprintf(stderr, "Cannot start %d render workers, running with %d\n", jobs, workers);
+    }
+    printf("WORKERS %d\n", workers);
+
+    if (song && smf_load(song) != 0) return 1;
+
+    if (out) return render_offline(out, script, tail);
+
+    if (strcmp(device, "null") == 0) sink = &null_backend;
+    if (sink->open(device) != 0) {
+        fprintf(stderr, "Cannot open %s output %s (use null to run without audio)\n",
+            sink->name, device);
+        return 1;
+    }
+    printf("OUTPUT %s %s %s (%s)\n", sink->name, device, format_names[out_format], convert_name);
+
+    linenoiseHistoryLoad(HISTORY_FILE);
 
-    pthread_t user_thread;
-    pthread_create(&user_thread, NULL, user, NULL);
-    pthread_detach(user_thread);
+    if (midi_open(midi_arg) != 0) {
+        fprintf(stderr, "Cannot open MIDI input %s\n", midi_arg);
+        return 1;
+    }
+    if (midi_source) printf("MIDI %s\n", midi_source);
+
+    // MIDI on stdin leaves no terminal for commands. The prompt may sit in
+    // linenoise forever, so it is never joined; exit takes it down.
+    if (midi_fd != 0) {
+        pthread_t user_thread;
+        pthread_create(&user_thread, NULL, user, NULL);
+        pthread_detach(user_thread);
+    }
 
     pthread_t midi_thread;
     pthread_create(&midi_thread, NULL, midi, NULL);
-    pthread_detach(midi_thread);
 
-    gettimeofday(&rtns0, NULL);
+    meter_thread("audio");
+    stats_t0 = clock_ns(CLOCK_MONOTONIC);
+
+    if (depth > 0) {
+        if (pipe_init(depth) != 0) fprintf(stderr, "Cannot start the render thread, rendering inline\n");
+        else printf("PIPE %d periods ahead\n", pipe_depth);
+    }
 
-    audio_pid = getpid();
+    if (rt_prio > 0) rt_setup();
 
+    uint64_t ev[PROF_EVENTS];
     while (running) {
-        synth(buffer, ALSA_BUFFER);
-
-        if ((err = snd_pcm_wait(pcm_handle, 1000)) < 0) {
-            check_alsa_error(err, "PCM wait failed");
-        }
-        if ((err = snd_pcm_writei(pcm_handle, buffer, ALSA_BUFFER)) < 0) {
-            if (err == -EPIPE) {
-                // Recover from buffer underrun
-                snd_pcm_prepare(pcm_handle);
-            } else {
-                check_alsa_error(err, "Failed to write to PCM device");
-            }
+        if (pipe_depth) {
+            if (pipe_feed() < 0) break;
+        } else if (sink->begin) {
+            int frames = sink->period;
+            void *ring = sink->begin(&frames);
+            if (ring == NULL) break;
+            synth(ring, frames);
+            int profiling = prof_mark(ev);
+            if (sink->commit(frames) < 0) break;
+            if (profiling) prof_stage(PROF_OUT, -1, frames, ev);
         } else {
-            // try to not get too far ahead of realtime...
-            // without this, we get about 24 seconds ahead of realtime!
-            #define TV2MS(t) ((t.tv_sec*1000)+(t.tv_usec/1000))
-            sent+=ALSA_BUFFER;
-            gettimeofday(&rtns1, NULL);
-            rtms = TV2MS(rtns1)-TV2MS(rtns0);
-            btms = sent * 1000 / SAMPLE_RATE;
-            diff = btms - rtms;
-            if (diff > latency_hack_ms) {
-                diff -= latency_hack_ms;
-                usleep(diff * 1000);
-            }
+            synth(buffer, sink->period);
+            int profiling = prof_mark(ev);
+            if (sink->write(buffer, sink->period) < 0) break;
+            if (profiling) prof_stage(PROF_OUT, -1, sink->period, ev);
         }
     }
 
     // Cleanup and close
-    snd_pcm_close(pcm_handle);
+    running = 0;
+    if (pipe_depth) pipe_stop();
+    sink->close();
 
-    pthread_join(user_thread, NULL);
+    midi_stop();
     pthread_join(midi_thread, NULL);
 
     linenoiseHistorySave(HISTORY_FILE);
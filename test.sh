@@ -0,0 +1,54 @@
+#!/bin/sh
+# offline renders checked sample by sample, make test
+SYNTH=${SYNTH:-./synth}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+fail=0
+from=0
+
+# largest absolute sample of a mono 16-bit wav from frame $2 on, the
+# header is 44 bytes
+peak() {
+    od -An -t d2 -v -j $((44 + 2 * ${2:-0})) "$1" | awk '
+        { for (i = 1; i <= NF; i++) { v = $i < 0 ? -$i : $i; if (v > m) m = v } }
+        END { print m + 0 }'
+}
+
+# name, the most the peak may be, script, synth arguments; the peak is
+# taken from frame $from on and the render has to exit cleanly
+check() {
+    name=$1 max=$2 script=$3
+    shift 3
+    if ! printf '%s\n' "$script" | "$SYNTH" -F s16 -o "$tmp/$name.wav" -t 0 "$@" > "$tmp/$name.log" 2>&1; then
+        echo "FAIL $name exit status"
+        fail=1
+        return
+    fi
+    p=$(peak "$tmp/$name.wav" "$from")
+    if [ "$p" -le "$max" ]; then
+        echo "ok   $name peak $p"
+    else
+        echo "FAIL $name peak $p over $max"
+        fail=1
+    fi
+}
+
+# four full scale squares through the limiter stay under its 0.977 ceiling
+check limit 32014 'v0 e0 w1 f220 a1 v1 e0 w1 f277 a1 v2 e0 w1 f330 a1 v3 e0 w1 f440 a1 ~1000' -l 5
+
+# a key the mapping leaves out is silent, under n and after a retune
+printf '! t\nwhite keys\n7\n9/8\n5/4\n4/3\n3/2\n5/3\n15/8\n2/1\n' > "$tmp/just.scl"
+printf '12\n0\n127\n60\n69\n440.0\n7\n0\nx\n1\nx\n2\n3\nx\n4\nx\n5\nx\n6\n' > "$tmp/white.kbm"
+check unmapped 0 "K $tmp/just.scl $tmp/white.kbm
+v0 e0 w1 a1 n61 l1 ~300"
+from=8192  # the period the K lands in
+check retuned 0 "v0 e0 w1 a1 n61 ~200
+K $tmp/just.scl $tmp/white.kbm
+~300"
+from=0
+
+# a track cut off inside a delta time ends there rather than reading on
+printf 'MThd\0\0\0\6\0\0\0\1\1\340MTrk\0\0\0\5\0\220\74\144\201' > "$tmp/cut.mid"
+check truncated 32767 '' -p "$tmp/cut.mid"
+
+exit $fail